@@ -3,26 +3,172 @@
 #ifndef COLLECTOR_H
 #define COLLECTOR_H
 
+#include "../stamp_time.h"
+
 // Max size support 100 flows sending at 5pps
 #define STAMP_MAP_SIZE 1800000
 
+// Max number of concurrent STAMP sessions tracked in hash maps
+#define STAMP_MAX_SESSIONS 1024
+
+// Ring buffer mode, bytes shared by all CPUs (power of 2, ~350k samples)
+#define STAMP_RINGBUF_SIZE (1 << 24)
+
 struct stamp_data
 {
     __u16 ssid;
+    __u16 vlan;     /* Outer VLAN ID, 0 if untagged */
     __u32 seq;
     __u32 test_tx[2];
     __u32 test_rx[2];
     __u32 reply_tx[2];
-    __u64 reply_rx;
+    __u64 reply_rx;     /* ns, clock given by rx_clock */
+    __u32 rx_clock;     /* enum rx_clock */
+    __u32 reserved;
+};
+
+/* Clock reply_rx was taken from */
+enum rx_clock {
+    RX_CLOCK_KERNEL,    /* bpf_ktime_get_ns(), CLOCK_MONOTONIC */
+    RX_CLOCK_HW,        /* NIC/driver RX timestamp, the NIC's PTP hardware
+                         * clock, used as is: only wall clock time if that
+                         * clock is disciplined to UTC (--hw-timestamp) */
+    RX_CLOCK_REALTIME,  /* Kernel clock converted when captured, see below */
+};
+
+
+/* Key of the per-session maps, sessions are told apart by SSID and VLAN */
+struct session_key
+{
+    __u16 ssid;
+    __u16 vlan;
 };
 
+/* How stamp_collector stores samples, selected at load time */
+enum collect_mode {
+    COLLECT_SHARED,
+    COLLECT_PERCPU,
+    COLLECT_RINGBUF,
+    COLLECT_HIST,
+};
 
 enum counter_map_key {
-    COUNTER_KEY
+    COUNTER_KEY,
+    COUNTER_MAP_SIZE
+};
+
+enum percpu_counter_map_key {
+    PERCPU_HEAD_KEY,    /* Per-CPU ring mode: samples written by this CPU */
+    RINGBUF_DROP_KEY,   /* Ring buffer mode: samples lost to a full buffer */
+    RX_TS_FALLBACK_KEY, /* Replies without a HW RX timestamp in --hw-timestamp */
+    CLOCK_FALLBACK_KEY, /* Replies before the clock offsets were written */
+    PERCPU_COUNTER_MAP_SIZE
+};
+
+
+/*
+ * Per-session loss, duplicate and reorder detection (RFC 4737 style).
+ *
+ * next_seq is one past the highest sequence number received so far. The
+ * window remembers which of the SEQ_WINDOW_BITS sequence numbers below
+ * next_seq have been seen, bit (seq % SEQ_WINDOW_BITS). A sequence number
+ * that leaves the window without having been received is counted as lost.
+ */
+#define SEQ_WINDOW_WORDS    4
+#define SEQ_WINDOW_BITS     (SEQ_WINDOW_WORDS * 64)
+
+struct seq_counters
+{
+    __u64 received;
+    __u64 lost;         /* Left the window without being received */
+    __u64 duplicate;    /* Received again while inside the window */
+    __u64 reordered;    /* Below next_seq, first copy, inside the window */
+    __u64 late;         /* Below the window, already counted as lost */
+};
+
+struct seq_state
+{
+    struct bpf_spin_lock lock;
+    __u32 started;
+    __u32 first_seq;
+    __u32 next_seq;
+    __u64 window[SEQ_WINDOW_WORDS];
+    struct seq_counters counters;
+};
+
+
+
+/*
+ * Histogram mode: log-linear latency histograms per session.
+ *
+ * Values below HIST_SUB_BUCKETS ns get a bucket each. Above that, every power
+ * of two is split into HIST_SUB_BUCKETS linear buckets, which bounds the
+ * relative bucket width to 1/HIST_SUB_BUCKETS. Values of 2^HIST_MAX_LOG2 ns
+ * (~68 s) and more go to HIST_OVERFLOW_BUCKET, which has no upper bound.
+ */
+#define HIST_SUB_BITS       4
+#define HIST_SUB_BUCKETS    (1 << HIST_SUB_BITS)
+#define HIST_MAX_LOG2       36
+#define HIST_OVERFLOW_BUCKET ((HIST_MAX_LOG2 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+#define HIST_BUCKETS        (HIST_OVERFLOW_BUCKET + 1)
+
+enum hist_metric {
+    HIST_RTT,           /* (reply_rx - test_tx) - (reply_tx - test_rx) */
+    HIST_RESIDENCE,     /* reply_tx - test_rx, time spent in the reflector */
+    HIST_METRICS
 };
 
+struct stamp_hist
+{
+    __u64 count[HIST_METRICS];
+    __u64 sum_ns[HIST_METRICS];
+    __u64 negative[HIST_METRICS];   /* Not bucketed, clocks out of sync */
+    __u64 bucket[HIST_METRICS][HIST_BUCKETS];
+};
+
+static __always_inline __u32 hist_log2(__u64 v)
+{
+    __u32 r = 0;
+
+    if (v >> 32) { v >>= 32; r += 32; }
+    if (v >> 16) { v >>= 16; r += 16; }
+    if (v >> 8)  { v >>= 8;  r += 8; }
+    if (v >> 4)  { v >>= 4;  r += 4; }
+    if (v >> 2)  { v >>= 2;  r += 2; }
+    if (v >> 1)  { r += 1; }
+    return r;
+}
+
+static __always_inline __u32 hist_bucket(__u64 value_ns)
+{
+    __u32 msb;
+
+    if (value_ns < HIST_SUB_BUCKETS)
+        return value_ns;
+    msb = hist_log2(value_ns);
+    if (msb >= HIST_MAX_LOG2)
+        return HIST_OVERFLOW_BUCKET;
+
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+           ((value_ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* Smallest value (in ns) that falls into bucket */
+static __always_inline __u64 hist_bucket_low(__u32 bucket)
+{
+    __u32 group = bucket / HIST_SUB_BUCKETS;
+
+    if (group == 0)
+        return bucket;
+    return (__u64)(HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS) << (group - 1);
+}
+
+/* Width of bucket in ns, HIST_OVERFLOW_BUCKET is unbounded */
+static __always_inline __u64 hist_bucket_width(__u32 bucket)
+{
+    __u32 group = bucket / HIST_SUB_BUCKETS;
 
-#define NTP_UNIX_OFFSET 2208988800
-#define NANOSEC_PER_SEC 1000000000 /* 10^9 */
+    return group == 0 ? 1 : (__u64)1 << (group - 1);
+}
 
 #endif  /* COLLECTOR_H */
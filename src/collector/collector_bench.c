@@ -0,0 +1,286 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Microbenchmarks of the collector output path and the timestamp
+ * conversions, run with "make bench"
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "collector_format.h"
+#include "collector_pipeline.h"
+
+#define BENCH_SAMPLES	(1 << 21)
+
+static __u64 now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * NANOSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* The former double conversions, for comparison */
+static double ntp2unix(__u32 seconds_part, __u32 fractional_part){
+	return (double)seconds_part + (double)fractional_part / (double)UINT32_MAX - NTP_UNIX_OFFSET;
+}
+
+static double uptime2unix(__u64 system_up_ns, double offset){
+	return (double)system_up_ns / NANOSEC_PER_SEC + offset;
+}
+
+/* The CSV rows as the collector wrote them with fprintf() before */
+static bool write_sample_printf(FILE *fp, const struct stamp_data *value, double offset){
+	double test_tx = ntp2unix(value->test_tx[0], value->test_tx[1]);
+	double test_rx = ntp2unix(value->test_rx[0], value->test_rx[1]);
+	double reply_tx = ntp2unix(value->reply_tx[0], value->reply_tx[1]);
+	double reply_rx = value->rx_clock == RX_CLOCK_HW ?
+		uptime2unix(value->reply_rx, 0) : uptime2unix(value->reply_rx, offset);
+
+	if (test_tx < 0 || test_rx < 0 || reply_tx < 0 || reply_rx < 0)
+		return false;
+
+	fprintf(fp, "%u,%u,%f,%f,%f,%f,%u,%u\n", value->ssid, value->seq, test_tx, test_rx,
+		reply_tx, reply_rx, value->vlan, value->rx_clock);
+	return true;
+}
+
+/* Samples of a 1 Mpps session, starting now, with up to ~1 us of jitter
+ * on the delays so the zdelta sizes are not flattered
+ */
+static void fill_samples(struct stamp_data *samples, __u32 n){
+	__u64 ntp = ((__u64)time(NULL) + NTP_UNIX_OFFSET) << 32;
+	__u64 up = now_ns() + 1000000;
+	__u32 i, jitter, x = 2463534242u;
+
+	for (i = 0; i < n; i++) {
+		struct stamp_data *d = &samples[i];
+		__u64 tx = ntp + (__u64)i * 4295;	/* ~1 us in 32.32 */
+
+		x ^= x << 13;				/* xorshift32 */
+		x ^= x >> 17;
+		x ^= x << 5;
+		jitter = x >> 20;			/* < 4096, ~1 us in 32.32 */
+
+		memset(d, 0, sizeof(*d));
+		d->ssid = i % 4;
+		d->seq = i;
+		d->test_tx[0] = tx >> 32;
+		d->test_tx[1] = (__u32)tx;
+		d->test_rx[0] = (tx + 85899 + jitter) >> 32;	/* ~20 us later */
+		d->test_rx[1] = (__u32)(tx + 85899 + jitter);
+		d->reply_tx[0] = (tx + 90194 + jitter) >> 32;
+		d->reply_tx[1] = (__u32)(tx + 90194 + jitter);
+		d->reply_rx = up + (__u64)i * 1000 + 41000 + jitter / 4;
+		d->rx_clock = RX_CLOCK_KERNEL;
+	}
+}
+
+/* Encode and write n samples through a pipeline of nr_workers threads */
+static int run_pipeline(FILE *fp, enum output_format format, __s64 offset_ns,
+			const struct stamp_data *samples, __u32 n, int nr_workers){
+	struct sample_writer writer;
+	struct pipeline *pipeline;
+	struct stamp_data *batch;
+	__u32 i, len;
+	__u64 saved = 0;
+	int err;
+
+	err = writer_init(&writer, fp, format, offset_ns);
+	if (err)
+		return err;
+	pipeline = pipeline_start(&writer, nr_workers, 0);
+	if (!pipeline) {
+		writer_free(&writer);
+		return -ENOMEM;
+	}
+	for (i = 0; i < n; i += len) {
+		len = n - i < PIPELINE_BATCH ? n - i : PIPELINE_BATCH;
+		batch = pipeline_next_batch(pipeline);
+		memcpy(batch, samples + i, len * sizeof(*batch));
+		pipeline_submit(pipeline, len);
+	}
+	err = pipeline_drain(pipeline, &saved);
+	if (pipeline_stop(pipeline, &saved) != 0 && !err)
+		err = -EIO;
+	writer_free(&writer);
+	return err;
+}
+
+static void report(const char *name, __u32 n, __u64 ns){
+	printf("%-16s %10u rows %8.3f s %12.0f rows/s\n", name, n, ns / 1e9,
+	       n / (ns / 1e9));
+}
+
+/* Output bytes per sample of each format, in blocks as the writer makes them */
+static void bench_sizes(const struct stamp_data *samples, __u32 n){
+	static const char *names[] = {"csv", "binary", "zdelta"};
+	enum output_format format;
+	__u64 size[3] = {0};
+	__u32 i, len, valid;
+	size_t cap = 0;
+	void *out;
+
+	for (format = FORMAT_CSV; format <= FORMAT_ZDELTA; format++) {
+		if (stamp_encoded_size(format, STAMP_BLOCK_SAMPLES) > cap)
+			cap = stamp_encoded_size(format, STAMP_BLOCK_SAMPLES);
+	}
+	out = malloc(cap);
+	if (!out)
+		return;
+	for (format = FORMAT_CSV; format <= FORMAT_ZDELTA; format++) {
+		for (i = 0; i < n; i += len) {
+			len = n - i < STAMP_BLOCK_SAMPLES ? n - i : STAMP_BLOCK_SAMPLES;
+			size[format] += encode_samples(format, 0, samples + i, len, out, &valid);
+		}
+		printf("%-16s %10u rows %8.2f bytes/row %7.1fx smaller than csv\n",
+		       names[format], n, (double)size[format] / n,
+		       (double)size[FORMAT_CSV] / size[format]);
+	}
+	free(out);
+}
+
+static void report_conv(const char *name, __u32 n, __u64 ns){
+	printf("%-16s %10u conv %8.3f s %12.2f ns/conv\n", name, n, ns / 1e9, (double)ns / n);
+}
+
+/* Throughput of the stamp_time.h conversions against the double ones. The
+ * sums keep the compiler from dropping the loops.
+ */
+static void bench_conversions(const struct stamp_data *samples, __u32 n){
+	volatile double dsink;
+	volatile __u64 sink;
+	double dsum = 0;
+	__u64 sum = 0, start;
+	__u32 i;
+
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		dsum += ntp2unix(samples[i].test_tx[0], samples[i].test_tx[1]);
+	report_conv("ntp2unix", n, now_ns() - start);
+	dsink = dsum;
+
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		sum += stamp_ntp_to_ns(stamp_ts64(samples[i].test_tx[0], samples[i].test_tx[1]));
+	report_conv("ntp_to_ns", n, now_ns() - start);
+
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		sum += stamp_ns_to_ntp(samples[i].reply_rx);
+	report_conv("ns_to_ntp", n, now_ns() - start);
+
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		sum += stamp_ptp_to_ns(stamp_ns_to_ptp(samples[i].reply_rx));
+	report_conv("ptp roundtrip", n, now_ns() - start);
+
+	/* ns -> NTP -> ns is exact */
+	for (i = 0; i < n; i++) {
+		if (stamp_ntp_to_ns(stamp_ns_to_ntp(samples[i].reply_rx)) != samples[i].reply_rx) {
+			fprintf(stderr, "ERR: NTP roundtrip of %llu ns\n",
+				(unsigned long long)samples[i].reply_rx);
+			break;
+		}
+	}
+	sink = sum;
+	(void)sink;
+	(void)dsink;
+}
+
+int main(int argc, char **argv){
+	const char *path = argc > 1 ? argv[1] : "/dev/null";
+	__s64 offset_ns = (__s64)time(NULL) * NANOSEC_PER_SEC - now_ns();
+	struct sample_writer writer;
+	struct stamp_data *samples;
+	__u32 i, n = BENCH_SAMPLES;
+	__u64 start;
+	FILE *fp;
+	int err;
+
+	samples = malloc(n * sizeof(*samples));
+	if (!samples)
+		return EXIT_FAILURE;
+	fill_samples(samples, n);
+	bench_conversions(samples, n);
+	bench_sizes(samples, n);
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		fprintf(stderr, "ERR: opening %s: %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		write_sample_printf(fp, &samples[i], (double)offset_ns / NANOSEC_PER_SEC);
+	fclose(fp);
+	report("csv (fprintf)", n, now_ns() - start);
+
+	fp = fopen(path, "w");
+	if (!fp)
+		return EXIT_FAILURE;
+	start = now_ns();
+	err = writer_init(&writer, fp, FORMAT_CSV, offset_ns);
+	for (i = 0; !err && i < n; i++)
+		write_sample(&writer, &samples[i]);
+	err = err ? err : writer_flush(&writer);
+	writer_free(&writer);
+	fclose(fp);
+	report("csv", n, now_ns() - start);
+
+	fp = fopen(path, "w");
+	if (!fp)
+		return EXIT_FAILURE;
+	start = now_ns();
+	err = err ? err : writer_init(&writer, fp, FORMAT_BINARY, offset_ns);
+	for (i = 0; !err && i < n; i++)
+		write_sample(&writer, &samples[i]);
+	err = err ? err : writer_flush(&writer);
+	writer_free(&writer);
+	fclose(fp);
+	report("binary", n, now_ns() - start);
+
+	fp = fopen(path, "w");
+	if (!fp)
+		return EXIT_FAILURE;
+	start = now_ns();
+	err = err ? err : writer_init(&writer, fp, FORMAT_ZDELTA, offset_ns);
+	for (i = 0; !err && i < n; i++)
+		write_sample(&writer, &samples[i]);
+	err = err ? err : writer_flush(&writer);
+	writer_free(&writer);
+	fclose(fp);
+	report("zdelta", n, now_ns() - start);
+
+	for (int workers = 1; !err && workers <= sysconf(_SC_NPROCESSORS_ONLN) &&
+	     workers <= PIPELINE_MAX_WORKERS; workers *= 2) {
+		char name[32];
+
+		fp = fopen(path, "w");
+		if (!fp)
+			return EXIT_FAILURE;
+		start = now_ns();
+		err = run_pipeline(fp, FORMAT_CSV, offset_ns, samples, n, workers);
+		fclose(fp);
+		snprintf(name, sizeof(name), "csv %d threads", workers);
+		report(name, n, now_ns() - start);
+
+		fp = fopen(path, "w");
+		if (!fp)
+			return EXIT_FAILURE;
+		start = now_ns();
+		err = err ? err : run_pipeline(fp, FORMAT_ZDELTA, offset_ns, samples, n, workers);
+		fclose(fp);
+		snprintf(name, sizeof(name), "zdelta %d threads", workers);
+		report(name, n, now_ns() - start);
+	}
+
+	free(samples);
+	if (err) {
+		fprintf(stderr, "ERR: writing %s: %s\n", path, strerror(-err));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+static const char *__doc__ = "Convert a binary or zdelta collector_user output file to CSV\n";
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../common/common_defines.h"
+#include "collector_format.h"
+
+int main(int argc, char **argv)
+{
+	struct stamp_file_header fhdr;
+	struct stamp_block_header bhdr;
+	struct stamp_data *samples = NULL;
+	struct sample_writer writer;
+	bool started = false;
+	__u64 total = 0, saved = 0;
+	__u32 capacity = 0;
+	FILE *in_fp, *out_fp = stdout;
+	int rec, err = 0;
+
+	if (argc < 2 || argc > 3 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+		printf("Usage: %s <in-file> [<out-file>]\n\n%s", argv[0], __doc__);
+		printf("Writes to stdout if <out-file> is not given.\n");
+		return argc == 2 ? EXIT_OK : EXIT_FAIL_OPTION;
+	}
+
+	in_fp = fopen(argv[1], "rb");
+	if (!in_fp) {
+		fprintf(stderr, "ERR: opening %s: %s\n", argv[1], strerror(errno));
+		return EXIT_FAIL;
+	}
+	if (argc == 3) {
+		out_fp = fopen(argv[2], "w");
+		if (!out_fp) {
+			fprintf(stderr, "ERR: opening %s: %s\n", argv[2], strerror(errno));
+			fclose(in_fp);
+			return EXIT_FAIL;
+		}
+	}
+
+	while ((rec = read_record(in_fp, &fhdr, &bhdr)) > 0) {
+		if (rec == RECORD_FILE_HEADER) {
+			/* A later header starts a new run with its own clock offset */
+			if (!started)
+				err = writer_init(&writer, out_fp, FORMAT_CSV, fhdr.clock_offset_ns);
+			writer.offset_ns = fhdr.clock_offset_ns;
+			started = true;
+			if (err)
+				break;
+			continue;
+		}
+		if (!started) {
+			err = -EINVAL;
+			break;
+		}
+
+		if (bhdr.count > capacity) {
+			struct stamp_data *grown = realloc(samples, bhdr.count * sizeof(*samples));
+
+			if (!grown) {
+				err = -ENOMEM;
+				break;
+			}
+			samples = grown;
+			capacity = bhdr.count;
+		}
+		if (rec == RECORD_ZBLOCK)
+			err = read_zblock(in_fp, bhdr.count, samples);
+		else
+			err = read_block(in_fp, bhdr.count, samples);
+		if (err)
+			break;
+
+		for (__u32 i = 0; i < bhdr.count; i++) {
+			if (write_sample(&writer, &samples[i]))
+				saved++;
+		}
+		total += bhdr.count;
+	}
+	if (rec < 0)
+		err = rec;
+	if (started) {
+		if (!err)
+			err = writer_flush(&writer);
+		writer_free(&writer);
+	}
+
+	free(samples);
+	fclose(in_fp);
+	if (out_fp != stdout)
+		fclose(out_fp);
+
+	if (err) {
+		fprintf(stderr, "ERR: %s is not a valid collector binary or zdelta file: %s\n",
+			argv[1], strerror(-err));
+		return EXIT_FAIL;
+	}
+	fprintf(stderr, "%llu samples converted, %llu failed validation\n",
+		(unsigned long long)saved, (unsigned long long)(total - saved));
+	return EXIT_OK;
+}
@@ -0,0 +1,809 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* CSV, binary columnar and delta-encoded sample output, see collector_format.h */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "collector_format.h"
+
+/* Start a file or segment with the CSV header or the binary file header */
+static int write_header(struct sample_writer *w){
+	struct stamp_file_header hdr = {
+		.version = STAMP_FILE_VERSION,
+		.block_samples = STAMP_BLOCK_SAMPLES,
+		.clock_offset_ns = w->offset_ns,
+	};
+
+	if (w->format == FORMAT_CSV) {
+		/* Appending to a CSV file, or not seekable (e.g. a pipe) */
+		if (ftell(w->fp) <= 0)
+			fprintf(w->fp, CSV_HEADER);
+		return 0;
+	}
+
+	/* Every run starts with its own header, its offset applies from here */
+	memcpy(hdr.magic, STAMP_FILE_MAGIC, sizeof(hdr.magic));
+	if (fwrite(&hdr, sizeof(hdr), 1, w->fp) != 1)
+		return -EIO;
+	return 0;
+}
+
+static int writer_setup(struct sample_writer *w, FILE *fp, enum output_format format, __s64 offset_ns){
+	memset(w, 0, sizeof(*w));
+	w->fp = fp;
+	w->format = format;
+	w->offset_ns = offset_ns;
+
+	if (format == FORMAT_CSV) {
+		w->csv_buf = malloc(CSV_BUF_SIZE);
+		return w->csv_buf ? 0 : -ENOMEM;
+	}
+
+	w->block = malloc(STAMP_BLOCK_SAMPLES * sizeof(*w->block));
+	w->columns = malloc(stamp_encoded_size(format, STAMP_BLOCK_SAMPLES));
+	if (!w->block || !w->columns) {
+		writer_free(w);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/* Start writing samples to fp, which may already hold earlier samples */
+int writer_init(struct sample_writer *w, FILE *fp, enum output_format format, __s64 offset_ns){
+	int err = writer_setup(w, fp, format, offset_ns);
+
+	return err ? err : write_header(w);
+}
+
+static __u64 realtime_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (__u64)ts.tv_sec * NANOSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void segment_name(char *buf, size_t size, const char *path, __u32 n){
+	snprintf(buf, size, "%s.%06u", path, n);
+}
+
+/* Open segment w->segment and start it with a header */
+static int open_segment(struct sample_writer *w){
+	char name[PATH_MAX];
+	__u64 now = realtime_ns();
+
+	segment_name(name, sizeof(name), w->path, w->segment);
+	w->fp = fopen(name, "w");
+	if (!w->fp)
+		return -errno;
+	w->segment_bytes = 0;
+	/* Timed segments end on multiples of the interval, e.g. on the hour */
+	if (w->rotate_ns)
+		w->segment_end_ns = (now / w->rotate_ns + 1) * w->rotate_ns;
+	return write_header(w);
+}
+
+/* Write out and sync the open segment, so a closed segment is on disk */
+static int close_segment(struct sample_writer *w){
+	int err = 0;
+
+	if (!w->fp)
+		return 0;
+	if (fflush(w->fp) != 0 || fsync(fileno(w->fp)) != 0)
+		err = -EIO;
+	if (fclose(w->fp) != 0 && !err)
+		err = -EIO;
+	w->fp = NULL;
+	return err;
+}
+
+/* Move on to the next segment if the open one is full or its time is up.
+ * A segment that failed to open is retried on every write.
+ */
+static int rotate_if_due(struct sample_writer *w){
+	bool full, expired;
+	int err;
+
+	if (!w->path)
+		return 0;
+	if (!w->fp)
+		return open_segment(w);
+
+	full = w->rotate_bytes && w->segment_bytes >= w->rotate_bytes;
+	expired = w->rotate_ns && realtime_ns() >= w->segment_end_ns;
+	if (expired && w->segment_bytes == 0) {
+		/* Nothing to close, keep the empty segment for the next interval */
+		w->segment_end_ns = (realtime_ns() / w->rotate_ns + 1) * w->rotate_ns;
+		expired = false;
+	}
+	if (!full && !expired)
+		return 0;
+
+	err = close_segment(w);
+	w->segment++;
+	if (open_segment(w) != 0 && !err)
+		err = -EIO;
+	return err;
+}
+
+/* Close the open segment if its time is up, for a writer that has nothing
+ * to write: otherwise it would stay open, and not synced, until the next
+ * sample arrives.
+ */
+int writer_rotate_due(struct sample_writer *w){
+	if (!w->path || !w->fp)
+		return 0;
+	return rotate_if_due(w);
+}
+
+/*
+ * Write samples to numbered segments <path>.000000, <path>.000001, ... which
+ * each start with their own header. The next segment is started once the
+ * open one holds max_bytes (0 for no limit), or once CLOCK_REALTIME passes
+ * a multiple of interval_ns (0 for no limit). Segments are only split
+ * between blocks or buffered CSV writes, and are synced when they close.
+ * Numbering continues after the segments already present. path must stay
+ * valid until writer_close().
+ */
+int writer_init_segments(struct sample_writer *w, const char *path, enum output_format format,
+			 __s64 offset_ns, __u64 max_bytes, __u64 interval_ns){
+	char name[PATH_MAX];
+	int err;
+
+	err = writer_setup(w, NULL, format, offset_ns);
+	if (err)
+		return err;
+	w->path = path;
+	w->rotate_bytes = max_bytes;
+	w->rotate_ns = interval_ns;
+	for (;; w->segment++) {
+		segment_name(name, sizeof(name), path, w->segment);
+		if (access(name, F_OK) != 0)
+			break;
+	}
+
+	err = open_segment(w);
+	if (err)
+		writer_free(w);
+	return err;
+}
+
+/* Write len bytes straight to the file descriptor of w->fp */
+static int write_fd(struct sample_writer *w, const char *buf, size_t len){
+	size_t done = 0;
+	ssize_t n;
+
+	/* The header went through stdio */
+	if (fflush(w->fp) != 0)
+		return -EIO;
+	while (done < len) {
+		n = write(fileno(w->fp), buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -EIO;
+		done += n;
+	}
+	return 0;
+}
+
+/* Write len bytes of encoded samples, to the next segment if one is due */
+static int emit(struct sample_writer *w, const void *buf, size_t len){
+	int err, werr;
+
+	if (len == 0)
+		return 0;
+	err = rotate_if_due(w);
+	if (!w->fp)
+		return err ? err : -EIO;
+
+	if (w->format == FORMAT_CSV)
+		werr = write_fd(w, buf, len);
+	else
+		werr = fwrite(buf, len, 1, w->fp) == 1 ? 0 : -EIO;
+	w->segment_bytes += len;
+	return err ? err : werr;
+}
+
+/*
+ * CSV rows are formatted with integer arithmetic only. Timestamps are
+ * printed as Unix seconds with 9 decimals, see stamp_time.h.
+ */
+static char *format_u64(char *p, __u64 v){
+	char tmp[20];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n)
+		*p++ = tmp[--n];
+	return p;
+}
+
+static char *format_ns(char *p, __u64 ns){
+	__u32 frac = ns % NANOSEC_PER_SEC;
+	int i;
+
+	p = format_u64(p, ns / NANOSEC_PER_SEC);
+	*p++ = '.';
+	for (i = 8; i >= 0; i--) {
+		p[i] = '0' + frac % 10;
+		frac /= 10;
+	}
+	return p + 9;
+}
+
+/* Write out the formatted CSV rows in one go */
+static int flush_csv(struct sample_writer *w){
+	int err = emit(w, w->csv_buf, w->csv_len);
+
+	w->csv_len = 0;
+	return err;
+}
+
+/* Format one CSV row at p, return the end of the row or NULL if the sample
+ * failed validation.
+ */
+static char *format_csv_row(char *p, const struct stamp_data *value, __s64 offset_ns){
+	__u64 test_tx = stamp_ts64(value->test_tx[0], value->test_tx[1]);
+	__u64 test_rx = stamp_ts64(value->test_rx[0], value->test_rx[1]);
+	__u64 reply_tx = stamp_ts64(value->reply_tx[0], value->reply_tx[1]);
+	__s64 reply_rx = value->reply_rx;
+
+	// Only raw CLOCK_MONOTONIC readings still need the run's offset
+	if (value->rx_clock == RX_CLOCK_KERNEL)
+		reply_rx = stamp_ktime_to_ns(value->reply_rx, offset_ns);
+
+	// Validate data, timestamps before the Unix epoch are bogus
+	if (!stamp_ntp_valid(test_tx) || !stamp_ntp_valid(test_rx) ||
+	    !stamp_ntp_valid(reply_tx) || reply_rx < 0)
+		return NULL;
+
+	p = format_u64(p, value->ssid);
+	*p++ = ',';
+	p = format_u64(p, value->seq);
+	*p++ = ',';
+	p = format_ns(p, stamp_ntp_to_ns(test_tx));
+	*p++ = ',';
+	p = format_ns(p, stamp_ntp_to_ns(test_rx));
+	*p++ = ',';
+	p = format_ns(p, stamp_ntp_to_ns(reply_tx));
+	*p++ = ',';
+	p = format_ns(p, reply_rx);
+	*p++ = ',';
+	p = format_u64(p, value->vlan);
+	*p++ = ',';
+	p = format_u64(p, value->rx_clock);
+	*p++ = '\n';
+	return p;
+}
+
+static bool write_sample_csv(struct sample_writer *w, const struct stamp_data *value){
+	char *p = format_csv_row(w->csv_buf + w->csv_len, value, w->offset_ns);
+
+	if (!p)
+		return false;
+	w->csv_len = p - w->csv_buf;
+	if (w->csv_len > CSV_BUF_SIZE - CSV_MAX_ROW)
+		flush_csv(w);
+	return true;
+}
+
+/* Write one sample, return false if it failed validation. Binary samples
+ * are stored raw, the converter validates them.
+ */
+bool write_sample(struct sample_writer *w, const struct stamp_data *value){
+	if (w->format == FORMAT_CSV)
+		return write_sample_csv(w, value);
+
+	w->block[w->count++] = *value;
+	if (w->count == STAMP_BLOCK_SAMPLES)
+		writer_flush(w);
+	return true;
+}
+
+/* Block header and columns of n samples, stamp_encoded_size() bytes */
+static size_t encode_block(const struct stamp_data *samples, __u32 n, void *out){
+	struct stamp_block_header *bhdr = out;
+	size_t size = stamp_block_size(n);
+	__u32 i;
+
+	bhdr->magic = STAMP_BLOCK_MAGIC;
+	bhdr->count = n;
+
+	__u64 *test_tx = (__u64 *)(bhdr + 1);
+	__u64 *test_rx = test_tx + n;
+	__u64 *reply_tx = test_rx + n;
+	__u64 *reply_rx = reply_tx + n;
+	__u32 *seq = (__u32 *)(reply_rx + n);
+	__u16 *ssid = (__u16 *)(seq + n);
+	__u16 *vlan = ssid + n;
+	__u8 *rx_clock = (__u8 *)(vlan + n);
+
+	for (i = 0; i < n; i++) {
+		const struct stamp_data *d = &samples[i];
+
+		test_tx[i] = stamp_ts64(d->test_tx[0], d->test_tx[1]);
+		test_rx[i] = stamp_ts64(d->test_rx[0], d->test_rx[1]);
+		reply_tx[i] = stamp_ts64(d->reply_tx[0], d->reply_tx[1]);
+		reply_rx[i] = d->reply_rx;
+		seq[i] = d->seq;
+		ssid[i] = d->ssid;
+		vlan[i] = d->vlan;
+		rx_clock[i] = d->rx_clock;
+	}
+	memset(rx_clock + n, 0, (__u8 *)test_tx + size - (rx_clock + n));
+	return sizeof(*bhdr) + size;
+}
+
+/*
+ * Delta encoding, see collector_format.h. The state of up to
+ * STAMP_MAX_SESSIONS sessions is kept in an open addressing table, which
+ * is built from the ssid and vlan columns the same way by the encoder and
+ * the decoder.
+ */
+#define ZD_TABLE_SIZE	(2 * STAMP_MAX_SESSIONS)
+#define ZD_NO_SESSION	ZD_TABLE_SIZE
+
+enum zd_column {
+	ZD_SSID,
+	ZD_VLAN,
+	ZD_RX_CLOCK,
+	ZD_SEQ,
+	ZD_TEST_TX,
+	ZD_TEST_RX,
+	ZD_REPLY_TX,
+	ZD_REPLY_RX,
+};
+
+struct zd_session {
+	__u32 key;		/* ssid << 16 | vlan */
+	bool used;
+	__u32 seq;
+	__u64 test_tx;
+	__u64 tx_delta;
+	__u64 fwd;
+};
+
+static __u64 zigzag(__s64 v){
+	return (__u64)v << 1 ^ (__u64)(v >> 63);
+}
+
+static __s64 unzigzag(__u64 v){
+	return (__s64)(v >> 1 ^ -(v & 1));
+}
+
+static __u8 *put_varint(__u8 *p, __u64 v){
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static int get_varint(const __u8 **p, const __u8 *end, __u64 *v){
+	const __u8 *q = *p;
+	int shift;
+
+	*v = 0;
+	for (shift = 0; q < end && shift < 7 * STAMP_ZD_MAX_VARINT; shift += 7) {
+		*v |= (__u64)(*q & 0x7f) << shift;
+		if (!(*q++ & 0x80)) {
+			*p = q;
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+/* Assign each sample the table slot of its session, or ZD_NO_SESSION */
+static void zd_sessions(struct zd_session *table, const struct stamp_data *samples, __u32 n,
+			__u16 *idx){
+	__u32 i, h, key, nr = 0;
+
+	memset(table, 0, ZD_TABLE_SIZE * sizeof(*table));
+	for (i = 0; i < n; i++) {
+		key = (__u32)samples[i].ssid << 16 | samples[i].vlan;
+		h = ((__u32)samples[i].ssid * 2654435761u ^ samples[i].vlan) % ZD_TABLE_SIZE;
+
+		/* Half the table stays empty, so the probe always ends */
+		while (table[h].used && table[h].key != key)
+			h = (h + 1) % ZD_TABLE_SIZE;
+		if (!table[h].used) {
+			if (nr >= STAMP_MAX_SESSIONS) {
+				idx[i] = ZD_NO_SESSION;
+				continue;
+			}
+			table[h].used = true;
+			table[h].key = key;
+			nr++;
+		}
+		idx[i] = h;
+	}
+}
+
+/* Session state of a sample, untracked sessions start from 0 every time */
+static struct zd_session *zd_state(struct zd_session *table, __u16 idx, struct zd_session *none){
+	if (idx == ZD_NO_SESSION) {
+		memset(none, 0, sizeof(*none));
+		return none;
+	}
+	return &table[idx];
+}
+
+static __u8 *zd_encode_column(enum zd_column col, const struct stamp_data *samples, __u32 n,
+			      struct zd_session *table, const __u16 *idx, __u8 *p){
+	struct zd_session none, *s;
+	__u64 prev = 0, v = 0, test_tx, delta;
+	__u32 i;
+
+	for (i = 0; i < n; i++) {
+		const struct stamp_data *d = &samples[i];
+
+		switch (col) {
+		case ZD_SSID:
+			v = zigzag((__s64)d->ssid - (__s64)prev);
+			prev = d->ssid;
+			break;
+		case ZD_VLAN:
+			v = zigzag((__s64)d->vlan - (__s64)prev);
+			prev = d->vlan;
+			break;
+		case ZD_RX_CLOCK:
+			v = d->rx_clock;
+			break;
+		case ZD_SEQ:
+			s = zd_state(table, idx[i], &none);
+			v = zigzag((__s32)(d->seq - s->seq - 1));
+			s->seq = d->seq;
+			break;
+		case ZD_TEST_TX:
+			s = zd_state(table, idx[i], &none);
+			test_tx = stamp_ts64(d->test_tx[0], d->test_tx[1]);
+			delta = test_tx - s->test_tx;
+			v = zigzag(delta - s->tx_delta);
+			s->tx_delta = delta;
+			s->test_tx = test_tx;
+			break;
+		case ZD_TEST_RX:
+			s = zd_state(table, idx[i], &none);
+			delta = stamp_ts64(d->test_rx[0], d->test_rx[1]) -
+				stamp_ts64(d->test_tx[0], d->test_tx[1]);
+			v = zigzag(delta - s->fwd);
+			s->fwd = delta;
+			break;
+		case ZD_REPLY_TX:
+			v = zigzag(stamp_ts64(d->reply_tx[0], d->reply_tx[1]) -
+				   stamp_ts64(d->test_rx[0], d->test_rx[1]));
+			break;
+		case ZD_REPLY_RX:
+			v = zigzag(d->reply_rx - prev);
+			prev = d->reply_rx;
+			break;
+		}
+		p = put_varint(p, v);
+	}
+	return p;
+}
+
+static int zd_decode_column(enum zd_column col, struct stamp_data *samples, __u32 n,
+			    struct zd_session *table, const __u16 *idx,
+			    const __u8 **p, const __u8 *end){
+	struct zd_session none, *s;
+	__u64 prev = 0, v, ts;
+	__u32 i;
+
+	for (i = 0; i < n; i++) {
+		struct stamp_data *d = &samples[i];
+
+		if (get_varint(p, end, &v))
+			return -EINVAL;
+		switch (col) {
+		case ZD_SSID:
+			prev = d->ssid = prev + unzigzag(v);
+			break;
+		case ZD_VLAN:
+			prev = d->vlan = prev + unzigzag(v);
+			break;
+		case ZD_RX_CLOCK:
+			d->rx_clock = v;
+			break;
+		case ZD_SEQ:
+			s = zd_state(table, idx[i], &none);
+			d->seq = s->seq + 1 + (__u32)unzigzag(v);
+			s->seq = d->seq;
+			break;
+		case ZD_TEST_TX:
+			s = zd_state(table, idx[i], &none);
+			s->tx_delta += unzigzag(v);
+			s->test_tx += s->tx_delta;
+			d->test_tx[0] = s->test_tx >> 32;
+			d->test_tx[1] = (__u32)s->test_tx;
+			break;
+		case ZD_TEST_RX:
+			s = zd_state(table, idx[i], &none);
+			s->fwd += unzigzag(v);
+			ts = stamp_ts64(d->test_tx[0], d->test_tx[1]) + s->fwd;
+			d->test_rx[0] = ts >> 32;
+			d->test_rx[1] = (__u32)ts;
+			break;
+		case ZD_REPLY_TX:
+			ts = stamp_ts64(d->test_rx[0], d->test_rx[1]) + unzigzag(v);
+			d->reply_tx[0] = ts >> 32;
+			d->reply_tx[1] = (__u32)ts;
+			break;
+		case ZD_REPLY_RX:
+			prev = d->reply_rx = prev + unzigzag(v);
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Delta-encoded block of n samples. out is laid out as
+ *
+ *   header, compressed or raw varints   written out
+ *   session table, session slots, raw varints   scratch
+ *
+ * see stamp_encoded_size().
+ */
+static size_t encode_zblock(const struct stamp_data *samples, __u32 n, void *out){
+	struct stamp_zblock_header *zhdr = out;
+	__u8 *payload = (__u8 *)(zhdr + 1);
+	struct zd_session *table = (struct zd_session *)(payload + stamp_zblock_raw_bound(n));
+	__u16 *idx = (__u16 *)(table + ZD_TABLE_SIZE);
+	__u8 *raw = (__u8 *)(idx + n), *p = raw;
+	enum zd_column col;
+
+	zd_sessions(table, samples, n, idx);
+	for (col = ZD_SSID; col <= ZD_REPLY_RX; col++)
+		p = zd_encode_column(col, samples, n, table, idx, p);
+
+	zhdr->magic = STAMP_ZBLOCK_MAGIC;
+	zhdr->count = n;
+	zhdr->raw_size = p - raw;
+	zhdr->size = zhdr->raw_size;
+#ifdef HAVE_ZSTD
+	/* Keep the varints if the frame would not be smaller */
+	size_t size = ZSTD_compress(payload, zhdr->raw_size - 1, raw, zhdr->raw_size,
+				    STAMP_ZSTD_LEVEL);
+
+	if (!ZSTD_isError(size))
+		zhdr->size = size;
+#endif
+	if (zhdr->size == zhdr->raw_size)
+		memcpy(payload, raw, zhdr->raw_size);
+	return sizeof(*zhdr) + zhdr->size;
+}
+
+/* Bytes of the buffer encode_samples() needs for count samples, an upper
+ * bound of the bytes it produces
+ */
+size_t stamp_encoded_size(enum output_format format, __u32 count){
+	if (format == FORMAT_CSV)
+		return (size_t)count * CSV_MAX_ROW;
+	if (format == FORMAT_ZDELTA)
+		return sizeof(struct stamp_zblock_header) + 2 * stamp_zblock_raw_bound(count) +
+		       ZD_TABLE_SIZE * sizeof(struct zd_session) + count * sizeof(__u16);
+	return sizeof(struct stamp_block_header) + stamp_block_size(count);
+}
+
+/* Encode count samples into out as write_sample() would have written them,
+ * independently of any writer so batches can be encoded in parallel. A
+ * binary or zdelta batch becomes one block. Returns the length written to out and
+ * sets *valid to the number of samples that passed validation.
+ */
+size_t encode_samples(enum output_format format, __s64 offset_ns, const struct stamp_data *samples,
+		      __u32 count, void *out, __u32 *valid){
+	char *p = out, *end;
+	__u32 i;
+
+	if (format == FORMAT_BINARY) {
+		*valid = count;
+		return count ? encode_block(samples, count, out) : 0;
+	}
+	if (format == FORMAT_ZDELTA) {
+		*valid = count;
+		return count ? encode_zblock(samples, count, out) : 0;
+	}
+
+	*valid = 0;
+	for (i = 0; i < count; i++) {
+		end = format_csv_row(p, &samples[i], offset_ns);
+		if (!end)
+			continue;
+		p = end;
+		(*valid)++;
+	}
+	return p - (char *)out;
+}
+
+/* Append the output of encode_samples() after everything written so far */
+int writer_write_encoded(struct sample_writer *w, const void *buf, size_t len){
+	int err = writer_flush(w);
+
+	return err ? err : emit(w, buf, len);
+}
+
+/* Write the pending binary block, transposed into columns, or zdelta block */
+int writer_flush(struct sample_writer *w){
+	size_t len;
+
+	if (w->format == FORMAT_CSV)
+		return flush_csv(w);
+	if (w->count == 0)
+		return 0;
+
+	if (w->format == FORMAT_ZDELTA)
+		len = encode_zblock(w->block, w->count, w->columns);
+	else
+		len = encode_block(w->block, w->count, w->columns);
+	w->count = 0;
+	return emit(w, w->columns, len);
+}
+
+/* Write out what is pending, and close the open segment when writing
+ * segments. Otherwise the caller still closes its fp.
+ */
+int writer_close(struct sample_writer *w){
+	int err = writer_flush(w);
+	int cerr = w->path ? close_segment(w) : 0;
+
+	return err ? err : cerr;
+}
+
+void writer_free(struct sample_writer *w){
+	if (w->path && w->fp) {
+		fclose(w->fp);
+		w->fp = NULL;
+	}
+	free(w->block);
+	free(w->columns);
+	free(w->csv_buf);
+	w->block = NULL;
+	w->columns = NULL;
+	w->csv_buf = NULL;
+}
+
+/* Read the next file or block header of a binary or zdelta file. Only the
+ * magic and count of a zdelta block header are read, read_zblock() reads
+ * the rest. Returns an enum stamp_record, or a negative errno if the file
+ * is not in the format.
+ */
+int read_record(FILE *fp, struct stamp_file_header *fhdr, struct stamp_block_header *bhdr){
+	__u32 magic;
+
+	if (fread(&magic, sizeof(magic), 1, fp) != 1)
+		return feof(fp) ? RECORD_END : -EIO;
+
+	if (magic == STAMP_BLOCK_MAGIC || magic == STAMP_ZBLOCK_MAGIC) {
+		bhdr->magic = magic;
+		if (fread(&bhdr->count, sizeof(bhdr->count), 1, fp) != 1)
+			return -EIO;
+		return magic == STAMP_BLOCK_MAGIC ? RECORD_BLOCK : RECORD_ZBLOCK;
+	}
+
+	memcpy(fhdr->magic, &magic, sizeof(magic));
+	if (fread(fhdr->magic + sizeof(magic), sizeof(*fhdr) - sizeof(magic), 1, fp) != 1)
+		return -EIO;
+	if (memcmp(fhdr->magic, STAMP_FILE_MAGIC, sizeof(fhdr->magic)) != 0)
+		return -EINVAL;
+	if (fhdr->version != STAMP_FILE_VERSION)
+		return -ENOTSUP;
+	return RECORD_FILE_HEADER;
+}
+
+/* Read the columns of a block of count samples back into samples */
+int read_block(FILE *fp, __u32 count, struct stamp_data *samples){
+	size_t size = stamp_block_size(count);
+	void *columns;
+	__u32 i;
+
+	columns = malloc(size ? size : 1);
+	if (!columns)
+		return -ENOMEM;
+	if (size && fread(columns, size, 1, fp) != 1) {
+		free(columns);
+		return -EIO;
+	}
+
+	__u64 *test_tx = columns;
+	__u64 *test_rx = test_tx + count;
+	__u64 *reply_tx = test_rx + count;
+	__u64 *reply_rx = reply_tx + count;
+	__u32 *seq = (__u32 *)(reply_rx + count);
+	__u16 *ssid = (__u16 *)(seq + count);
+	__u16 *vlan = ssid + count;
+	__u8 *rx_clock = (__u8 *)(vlan + count);
+
+	for (i = 0; i < count; i++) {
+		struct stamp_data *d = &samples[i];
+
+		memset(d, 0, sizeof(*d));
+		d->test_tx[0] = test_tx[i] >> 32;
+		d->test_tx[1] = (__u32)test_tx[i];
+		d->test_rx[0] = test_rx[i] >> 32;
+		d->test_rx[1] = (__u32)test_rx[i];
+		d->reply_tx[0] = reply_tx[i] >> 32;
+		d->reply_tx[1] = (__u32)reply_tx[i];
+		d->reply_rx = reply_rx[i];
+		d->seq = seq[i];
+		d->ssid = ssid[i];
+		d->vlan = vlan[i];
+		d->rx_clock = rx_clock[i];
+	}
+
+	free(columns);
+	return 0;
+}
+
+/* Read and decode a zdelta block of count samples following read_record() */
+int read_zblock(FILE *fp, __u32 count, struct stamp_data *samples){
+	struct zd_session *table = NULL;
+	__u8 *buf = NULL, *raw = NULL;
+	const __u8 *p;
+	__u16 *idx = NULL;
+	__u32 sizes[2];
+	enum zd_column col;
+	int err = -ENOMEM;
+
+	if (fread(sizes, sizeof(sizes), 1, fp) != 1)
+		return -EIO;
+	if (sizes[0] > stamp_zblock_raw_bound(count) || sizes[1] > sizes[0])
+		return -EINVAL;
+
+	buf = malloc(sizes[1] ? sizes[1] : 1);
+	raw = sizes[1] == sizes[0] ? buf : malloc(sizes[0]);
+	table = malloc(ZD_TABLE_SIZE * sizeof(*table));
+	idx = malloc(count ? count * sizeof(*idx) : 1);
+	if (!buf || !raw || !table || !idx)
+		goto out;
+
+	err = -EIO;
+	if (sizes[1] && fread(buf, sizes[1], 1, fp) != 1)
+		goto out;
+	if (raw != buf) {
+#ifdef HAVE_ZSTD
+		size_t size = ZSTD_decompress(raw, sizes[0], buf, sizes[1]);
+
+		err = -EINVAL;
+		if (ZSTD_isError(size) || size != sizes[0])
+			goto out;
+#else
+		/* Written by a collector built with zstd */
+		err = -ENOTSUP;
+		goto out;
+#endif
+	}
+
+	memset(samples, 0, count * sizeof(*samples));
+	p = raw;
+	for (col = ZD_SSID; col <= ZD_REPLY_RX; col++) {
+		/* Session slots follow from the ssid and vlan columns */
+		if (col == ZD_RX_CLOCK)
+			zd_sessions(table, samples, count, idx);
+		err = zd_decode_column(col, samples, count, table, idx, &p, raw + sizes[0]);
+		if (err)
+			goto out;
+	}
+	err = p == raw + sizes[0] ? 0 : -EINVAL;
+out:
+	if (raw != buf)
+		free(raw);
+	free(buf);
+	free(table);
+	free(idx);
+	return err;
+}
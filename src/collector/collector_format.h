@@ -0,0 +1,172 @@
+/* Output formats of collector_user, shared with collector_convert */
+#ifndef COLLECTOR_FORMAT_H
+#define COLLECTOR_FORMAT_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <linux/types.h>
+
+#include "collector.h"
+
+#define CSV_HEADER "ssid,seq,test_tx,test_rx,reply_tx,reply_rx,vlan,rx_clock\n"
+
+enum output_format {
+	FORMAT_CSV,
+	FORMAT_BINARY,
+	FORMAT_ZDELTA,
+};
+
+/*
+ * Binary columnar format (--format binary)
+ *
+ * All fields are in host byte order, a reader with the other byte order
+ * will not recognize the magic numbers. The file is a sequence of:
+ *
+ *   struct stamp_file_header
+ *   struct stamp_block_header, followed by the columns of its samples
+ *   struct stamp_block_header, ...
+ *
+ * A collector appending to an existing file starts with a new file header,
+ * whose clock offset applies to the blocks following it.
+ *
+ * Each block holds the columns of count samples, in this order:
+ *
+ *   __u64 test_tx[count]    NTP timestamps as (seconds << 32) | fraction
+ *   __u64 test_rx[count]
+ *   __u64 reply_tx[count]
+ *   __u64 reply_rx[count]   ns, clock given by rx_clock
+ *   __u32 seq[count]
+ *   __u16 ssid[count]
+ *   __u16 vlan[count]
+ *   __u8  rx_clock[count]   enum rx_clock
+ *
+ * padded with zeroes to a multiple of 8 bytes, see stamp_block_size().
+ */
+#define STAMP_FILE_MAGIC	"STAMPCOL"
+#define STAMP_FILE_VERSION	1
+#define STAMP_BLOCK_MAGIC	0x4b4c4253 /* "SBLK" */
+#define STAMP_BLOCK_SAMPLES	65536
+
+struct stamp_file_header {
+	char magic[8];		/* STAMP_FILE_MAGIC, not NUL terminated */
+	__u32 version;		/* STAMP_FILE_VERSION */
+	__u32 block_samples;	/* Max samples per block */
+	__s64 clock_offset_ns;	/* CLOCK_REALTIME - CLOCK_MONOTONIC, for RX_CLOCK_KERNEL */
+};
+
+struct stamp_block_header {
+	__u32 magic;		/* STAMP_BLOCK_MAGIC */
+	__u32 count;		/* Samples in this block */
+};
+
+/* Bytes of the columns following a block header */
+static inline size_t stamp_block_size(__u32 count)
+{
+	size_t size = (size_t)count * (4 * sizeof(__u64) + sizeof(__u32) +
+				       2 * sizeof(__u16) + sizeof(__u8));
+
+	return (size + 7) & ~(size_t)7;
+}
+
+/*
+ * Delta-encoded format (--format zdelta)
+ *
+ * The file header is the same as above, the blocks are:
+ *
+ *   struct stamp_zblock_header
+ *   size bytes, a zstd frame of raw_size bytes of varints, or the varints
+ *   themselves if size == raw_size
+ *
+ * Every block decodes on its own, so a reader can start at any block
+ * header and skip blocks by their size. The varints (unsigned LEB128) are
+ * stored column by column, count per column, in this order:
+ *
+ *   ssid      zigzag(ssid - ssid of the previous sample)
+ *   vlan      zigzag(vlan - vlan of the previous sample)
+ *   rx_clock
+ *   seq       zigzag(seq - previous seq of the session - 1), 32 bit
+ *   test_tx   zigzag(delta - previous delta of the session), where delta is
+ *             test_tx - previous test_tx of the session
+ *   test_rx   zigzag(fwd - previous fwd of the session), fwd = test_rx - test_tx
+ *   reply_tx  zigzag(reply_tx - test_rx)
+ *   reply_rx  zigzag(reply_rx - reply_rx of the previous sample)
+ *
+ * Timestamps are taken as __u64 like in the binary format, differences
+ * wrap modulo 2^64. A session is an (ssid, vlan) pair. Its previous values
+ * start at 0 in every block. Only the first STAMP_MAX_SESSIONS sessions of
+ * a block keep state, samples of further sessions are delta-encoded
+ * against 0.
+ */
+#define STAMP_ZBLOCK_MAGIC	0x5a4c4253 /* "SBLZ" */
+#define STAMP_ZD_COLUMNS	8
+#define STAMP_ZD_MAX_VARINT	10
+#define STAMP_ZSTD_LEVEL	1
+
+struct stamp_zblock_header {
+	__u32 magic;		/* STAMP_ZBLOCK_MAGIC */
+	__u32 count;		/* Samples in this block */
+	__u32 raw_size;		/* Bytes of the varints */
+	__u32 size;		/* Bytes following, == raw_size if not compressed */
+};
+
+/* Upper bound of the varints of a block */
+static inline size_t stamp_zblock_raw_bound(__u32 count)
+{
+	return (size_t)count * STAMP_ZD_COLUMNS * STAMP_ZD_MAX_VARINT;
+}
+
+/* CSV rows are formatted into a buffer of this size and written out with
+ * one write() whenever less than CSV_MAX_ROW bytes are left.
+ */
+#define CSV_BUF_SIZE	(1 << 20)
+#define CSV_MAX_ROW	128
+
+/* Writes samples in either format, see writer_init() */
+struct sample_writer {
+	FILE *fp;
+	enum output_format format;
+	__s64 offset_ns;		/* CLOCK_REALTIME - CLOCK_MONOTONIC */
+	struct stamp_data *block;	/* Binary, zdelta: samples of the pending block */
+	__u32 count;
+	void *columns;			/* Binary, zdelta: block as written out, see
+					 * stamp_encoded_size()
+					 */
+	char *csv_buf;			/* CSV: rows not written out yet */
+	size_t csv_len;
+	/* Rotating segments, see writer_init_segments() */
+	const char *path;		/* NULL if fp belongs to the caller */
+	__u32 segment;			/* Number of the open segment */
+	__u64 rotate_bytes;		/* 0: no size limit */
+	__u64 rotate_ns;		/* 0: no time limit */
+	__u64 segment_bytes;		/* Written to the open segment */
+	__u64 segment_end_ns;		/* CLOCK_REALTIME the open segment ends at */
+};
+
+int writer_init(struct sample_writer *w, FILE *fp, enum output_format format, __s64 offset_ns);
+int writer_init_segments(struct sample_writer *w, const char *path, enum output_format format,
+			 __s64 offset_ns, __u64 max_bytes, __u64 interval_ns);
+bool write_sample(struct sample_writer *w, const struct stamp_data *value);
+int writer_flush(struct sample_writer *w);
+int writer_rotate_due(struct sample_writer *w);
+int writer_close(struct sample_writer *w);
+void writer_free(struct sample_writer *w);
+
+/* Encoding batches apart from the writer, see encode_samples() */
+size_t stamp_encoded_size(enum output_format format, __u32 count);
+size_t encode_samples(enum output_format format, __s64 offset_ns, const struct stamp_data *samples,
+		      __u32 count, void *out, __u32 *valid);
+int writer_write_encoded(struct sample_writer *w, const void *buf, size_t len);
+
+/* Reading a binary or zdelta file, see read_record() */
+enum stamp_record {
+	RECORD_END,
+	RECORD_FILE_HEADER,
+	RECORD_BLOCK,
+	RECORD_ZBLOCK,
+};
+
+int read_record(FILE *fp, struct stamp_file_header *fhdr, struct stamp_block_header *bhdr);
+int read_block(FILE *fp, __u32 count, struct stamp_data *samples);
+int read_zblock(FILE *fp, __u32 count, struct stamp_data *samples);
+
+#endif /* COLLECTOR_FORMAT_H */
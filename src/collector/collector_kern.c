@@ -7,9 +7,11 @@
 
 #include <linux/if_ether.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/in.h>
 #include <linux/udp.h>
 #include <linux/bpf.h>
+#include <linux/pkt_cls.h>
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_endian.h>
 
@@ -17,39 +19,81 @@
 #include "collector.h"
 #include "../stamp.h"
 
+/* Load-time configuration, written into .rodata by collector_user before the
+ * program is loaded. The verifier treats these as constants, so filters left
+ * at their defaults and branches of modes not selected are removed.
+ */
+const volatile __u16 stamp_port_min = STAMP_PORT;
+const volatile __u16 stamp_port_max = STAMP_PORT;
+const volatile __u16 ssid_min = 0;
+const volatile __u16 ssid_max = 0xFFFF;
+const volatile __u8 local_ip_version = 0;	/* 0: any destination, 4 or 6 */
+const volatile __be32 local_ipv4 = 0;
+const volatile __be32 local_ipv6[4] = {};
+const volatile __u8 collect_mode = COLLECT_SHARED;
+const volatile __u32 seg_size = 0;	/* Per-CPU ring mode: entries owned by each CPU */
+const volatile __u8 seq_tracking = 1;
+const volatile __u8 hw_rx_timestamp = 0;
+const volatile __u8 tai_clock = 0;	/* bpf_ktime_get_tai_ns() exists (6.1+) */
+
+/* XDP RX metadata kfunc (Linux 6.3+), only usable by device-bound programs */
+extern int bpf_xdp_metadata_rx_timestamp(const struct xdp_md *ctx,
+					 __u64 *timestamp) __ksym __weak;
+
 
-static __always_inline struct stamp_reply_pkt* is_stamp_packet(struct hdr_cursor *nh, void *data_end){
+static __always_inline struct stamp_reply_pkt* is_stamp_packet(struct hdr_cursor *nh, void *data_end,
+								struct collect_vlans *vlans){
 
 	struct ethhdr *eth_hdr;
 	struct iphdr *ipv4_hdr;
+	struct ipv6hdr *ipv6_hdr;
 	struct udphdr *udp_hdr;
 	struct stamp_reply_pkt *stamp_reply_pkt;
 	int ip_hdrsize;
+	int h_proto;
+	__u16 port, ssid;
 
-	/* Parse ethernet header */
-	eth_hdr = nh->pos;
-	if (nh->pos + sizeof(*eth_hdr) > data_end)
+	/* Parse ethernet header, skipping up to VLAN_MAX_DEPTH VLAN tags */
+	h_proto = parse_ethhdr_vlan(nh, data_end, &eth_hdr, vlans);
+	if (h_proto < 0)
 		return NULL;
-	if (eth_hdr->h_proto != bpf_htons(ETH_P_IP))
-		return NULL;	
-	nh->pos += sizeof(*eth_hdr);
 
-	/* Parse IPv4 header */
-	ipv4_hdr = nh->pos;
-	if (ipv4_hdr + 1 > data_end)
-		return NULL;
-	ip_hdrsize = ipv4_hdr->ihl * 4;
-	// Sanity check packet field is valid
-	if(ip_hdrsize < sizeof(*ipv4_hdr))
-		return NULL;
-	// Variable-length IPv4 header, need to use byte-based arithmetic
-	if (nh->pos + ip_hdrsize > data_end)
-		return NULL;
-	// Check if UDP
-	if (ipv4_hdr->protocol != IPPROTO_UDP) {
+	if (h_proto == bpf_htons(ETH_P_IP)) {
+		/* Parse IPv4 header */
+		ipv4_hdr = nh->pos;
+		if (ipv4_hdr + 1 > data_end)
+			return NULL;
+		ip_hdrsize = ipv4_hdr->ihl * 4;
+		// Sanity check packet field is valid
+		if(ip_hdrsize < sizeof(*ipv4_hdr))
+			return NULL;
+		// Variable-length IPv4 header, need to use byte-based arithmetic
+		if (nh->pos + ip_hdrsize > data_end)
+			return NULL;
+		// Check if UDP
+		if (ipv4_hdr->protocol != IPPROTO_UDP) {
+			return NULL;
+		}
+		// Replies are addressed to the sender, optionally only to this one
+		if (local_ip_version == 6 ||
+		    (local_ip_version == 4 && ipv4_hdr->daddr != local_ipv4))
+			return NULL;
+		nh->pos += ip_hdrsize;
+	} else if (h_proto == bpf_htons(ETH_P_IPV6)) {
+		/* Parse IPv6 header, extension headers are not supported */
+		if (parse_ip6hdr(nh, data_end, &ipv6_hdr) != IPPROTO_UDP)
+			return NULL;
+		if (local_ip_version == 4)
+			return NULL;
+		if (local_ip_version == 6 &&
+		    (ipv6_hdr->daddr.in6_u.u6_addr32[0] != local_ipv6[0] ||
+		     ipv6_hdr->daddr.in6_u.u6_addr32[1] != local_ipv6[1] ||
+		     ipv6_hdr->daddr.in6_u.u6_addr32[2] != local_ipv6[2] ||
+		     ipv6_hdr->daddr.in6_u.u6_addr32[3] != local_ipv6[3]))
+			return NULL;
+	} else {
 		return NULL;
 	}
-	nh->pos += ip_hdrsize;
 
 	/* Parse UDP header */
 	udp_hdr = nh->pos;
@@ -59,7 +103,8 @@ static __always_inline struct stamp_reply_pkt* is_stamp_packet(struct hdr_cursor
 		return NULL;
 	}
 	// Check UDP source port, STAMP uses 862 by default
-	if (bpf_ntohs(udp_hdr->source) != 862)
+	port = bpf_ntohs(udp_hdr->source);
+	if (port < stamp_port_min || port > stamp_port_max)
 		return NULL;
 	nh->pos  = udp_hdr + 1;
 
@@ -71,6 +116,9 @@ static __always_inline struct stamp_reply_pkt* is_stamp_packet(struct hdr_cursor
 	if (stamp_reply_pkt->mbz16 || stamp_reply_pkt->mbz8[0] || stamp_reply_pkt->mbz8[1] || stamp_reply_pkt->mbz8[2]){
 		return NULL;
 	}
+	ssid = bpf_ntohs(stamp_reply_pkt->ssid);
+	if (ssid < ssid_min || ssid > ssid_max)
+		return NULL;
 
 	return stamp_reply_pkt;
 
@@ -81,37 +129,275 @@ struct {
 	__type(key, __u32);
 	__type(value, struct stamp_data);
 	__uint(max_entries, STAMP_MAP_SIZE);
+	__uint(map_flags, BPF_F_MMAPABLE);	/* Read by userspace through mmap() */
 	__uint(pinning, LIBBPF_PIN_BY_NAME);
 } stamp_data_map SEC(".maps");
 
 struct {
 	__uint(type, BPF_MAP_TYPE_ARRAY);
 	__type(key, __u32);
-	__type(value, __u32);
-	__uint(max_entries, 1);
+	__type(value, __u64);
+	__uint(max_entries, COUNTER_MAP_SIZE);
 	__uint(pinning, LIBBPF_PIN_BY_NAME);
 } counter_map SEC(".maps");
 
-SEC("xdp")
-int  stamp_collector(struct xdp_md *ctx)
+/* Per-CPU counters, see enum percpu_counter_map_key */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, __u32);
+	__type(value, __u64);
+	__uint(max_entries, PERCPU_COUNTER_MAP_SIZE);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} percpu_counter_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, STAMP_RINGBUF_SIZE);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} stamp_ringbuf SEC(".maps");
+
+/* Histogram mode: per-session latency histograms */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__type(key, struct session_key);
+	__type(value, struct stamp_hist);
+	__uint(max_entries, STAMP_MAX_SESSIONS);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} stamp_hist_map SEC(".maps");
+
+/* Zeroed template for new stamp_hist_map entries, too large for the stack */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, struct stamp_hist);
+	__uint(max_entries, 1);
+} hist_zero_map SEC(".maps");
+
+/* Offsets of the kernel clocks to CLOCK_REALTIME in ns, by enum
+ * clock_offset_key, refreshed by userspace while collecting
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, __s64);
+	__uint(max_entries, CLOCK_OFFSET_MAP_SIZE);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} clock_offset_map SEC(".maps");
+
+static __always_inline void hist_record(struct stamp_hist *hist, int metric, __s64 value_ns)
 {
-	void *data_end = (void *)(long)ctx->data_end;
-	void *data = (void *)(long)ctx->data;
-	struct hdr_cursor nh; /* These keep track of the next header type and iterator pointer */
-	struct stamp_data *temp_data;
-	struct stamp_reply_pkt *stamp_pkt;
-	__u32 *counter;
-	__u32 counter_map_key = COUNTER_KEY;
+	__u32 bucket;
 
-	nh.pos = data;
-	
-	stamp_pkt = is_stamp_packet(&nh, data_end);
-	if (!stamp_pkt){
-		return XDP_PASS;
+	if (value_ns < 0){
+		hist->negative[metric] += 1;
+		return;
 	}
 
-	// bpf_printk("Verified STAMP packet");
+	bucket = hist_bucket(value_ns);
+	if (bucket >= HIST_BUCKETS)
+		return;
+
+	hist->count[metric] += 1;
+	hist->sum_ns[metric] += value_ns;
+	hist->bucket[metric][bucket] += 1;
+}
+
+/* Per-session sequence number tracking */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, struct session_key);
+	__type(value, struct seq_state);
+	__uint(max_entries, STAMP_MAX_SESSIONS);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} seq_state_map SEC(".maps");
+
+static __always_inline __u64 seq_window_bit(__u32 seq)
+{
+	return 1ULL << (seq & 63);
+}
+
+static __always_inline __u64 *seq_window_word(struct seq_state *state, __u32 seq)
+{
+	return &state->window[(seq & (SEQ_WINDOW_BITS - 1)) >> 6];
+}
+
+/* Count lost, duplicated and reordered replies of the packet's session */
+static __always_inline void track_seq(struct stamp_reply_pkt *stamp_pkt, __u16 vlan)
+{
+	struct seq_state *state, new_state = {};
+	struct session_key key = {
+		.ssid = bpf_ntohs(stamp_pkt->ssid),
+		.vlan = vlan,
+	};
+	__u32 seq = bpf_ntohl(stamp_pkt->seq);
+	__u64 *word;
+	__u32 i, s;
+	__s32 diff;
+
+	state = bpf_map_lookup_elem(&seq_state_map, &key);
+	if (!state){
+		bpf_map_update_elem(&seq_state_map, &key, &new_state, BPF_NOEXIST);
+		state = bpf_map_lookup_elem(&seq_state_map, &key);
+		if (!state)
+			return;
+	}
+
+	bpf_spin_lock(&state->lock);
+
+	state->counters.received += 1;
+	if (!state->started){
+		state->started = 1;
+		state->first_seq = seq;
+		state->next_seq = seq;
+	}
+
+	diff = (__s32)(seq - state->next_seq);
+	if (diff >= SEQ_WINDOW_BITS){
+		/* Jumped past the whole window: every sequence number in it that
+		 * was not received, and every one skipped over, is lost.
+		 */
+		__u32 tracked = state->next_seq - state->first_seq;
+		__u32 received = 0;
+
+		if (tracked > SEQ_WINDOW_BITS)
+			tracked = SEQ_WINDOW_BITS;
+		for (i = 0; i < SEQ_WINDOW_WORDS; i++){
+			received += __builtin_popcountll(state->window[i]);
+			state->window[i] = 0;
+		}
+		state->counters.lost += (tracked - received) + (diff + 1 - SEQ_WINDOW_BITS);
+	}
+	else if (diff >= 0){
+		/* Slide the window up to seq, the slot of every sequence number
+		 * entering the window held the one leaving it.
+		 */
+		for (i = 0; i < SEQ_WINDOW_BITS; i++){
+			if (i > diff)
+				break;
+			s = state->next_seq + i;
+			word = seq_window_word(state, s);
+			if ((__s32)(s - SEQ_WINDOW_BITS - state->first_seq) >= 0 &&
+			    !(*word & seq_window_bit(s)))
+				state->counters.lost += 1;
+			*word &= ~seq_window_bit(s);
+		}
+	}
+
+	if (diff >= 0){
+		*seq_window_word(state, seq) |= seq_window_bit(seq);
+		state->next_seq = seq + 1;
+	}
+	else if (diff >= -SEQ_WINDOW_BITS){
+		word = seq_window_word(state, seq);
+		if (*word & seq_window_bit(seq)){
+			state->counters.duplicate += 1;
+		}
+		else{
+			state->counters.reordered += 1;
+			*word |= seq_window_bit(seq);
+		}
+	}
+	else{
+		state->counters.late += 1;
+	}
+
+	bpf_spin_unlock(&state->lock);
+}
+
+/* The kernel clock now, in CLOCK_REALTIME ns. CLOCK_TAI only differs from
+ * CLOCK_REALTIME by the TAI-UTC offset, so it is preferred when available;
+ * CLOCK_MONOTONIC is converted with the last offset userspace measured.
+ * Until the offsets are written, e.g. the program was loaded by another
+ * tool, the reading is left raw and counted.
+ */
+static __always_inline __u64 get_kernel_rx(__u32 *rx_clock)
+{
+	__u32 key = tai_clock ? CLOCK_OFFSET_TAI : CLOCK_OFFSET_MONO;
+	__u32 valid_key = CLOCK_OFFSET_VALID, fallback_key = CLOCK_FALLBACK_KEY;
+	__u64 now = tai_clock ? bpf_ktime_get_tai_ns() : bpf_ktime_get_ns();
+	__s64 *offset, *valid;
+	__u64 *fallbacks;
+
+	valid = bpf_map_lookup_elem(&clock_offset_map, &valid_key);
+	offset = bpf_map_lookup_elem(&clock_offset_map, &key);
+	if (!valid || !*valid || !offset){
+		/* Leave the conversion to userspace */
+		fallbacks = bpf_map_lookup_elem(&percpu_counter_map, &fallback_key);
+		if (fallbacks)
+			*fallbacks += 1;
+		*rx_clock = RX_CLOCK_KERNEL;
+		return bpf_ktime_get_ns();
+	}
+	*rx_clock = RX_CLOCK_REALTIME;
+	return stamp_ktime_to_ns(now, *offset);
+}
+
+/* Receive time of the reply. With hw_rx_timestamp the driver's RX
+ * timestamp is used when available, which excludes softirq scheduling
+ * delay; otherwise the kernel clock is read now. The driver timestamp is
+ * the NIC's PTP hardware clock, which is not converted: userspace requires
+ * that clock to be kept at UTC.
+ */
+static __always_inline __u64 get_reply_rx(struct xdp_md *ctx, __u32 *rx_clock)
+{
+	__u32 fallback_key = RX_TS_FALLBACK_KEY;
+	__u64 timestamp = 0;
+	__u64 *fallbacks;
+
+	if (hw_rx_timestamp){
+		if (bpf_ksym_exists(bpf_xdp_metadata_rx_timestamp) &&
+		    bpf_xdp_metadata_rx_timestamp(ctx, &timestamp) == 0 && timestamp){
+			*rx_clock = RX_CLOCK_HW;
+			return timestamp;
+		}
+		/* Driver without RX timestamp support, or none for this frame */
+		fallbacks = bpf_map_lookup_elem(&percpu_counter_map, &fallback_key);
+		if (fallbacks)
+			*fallbacks += 1;
+	}
+
+	return get_kernel_rx(rx_clock);
+}
+
+/* A packet timestamp in ns since the Unix epoch, NTP or PTPv2 by error_est */
+static __always_inline __u64 pkt_ts_to_ns(const __be32 ts[2], __be16 error_est)
+{
+	return stamp_ts_to_ns(stamp_ts64(bpf_ntohl(ts[0]), bpf_ntohl(ts[1])), bpf_ntohs(error_est));
+}
+
+/* Samples always hold NTP timestamps, PTPv2 ones are converted */
+static __always_inline void store_ntp(__u32 dst[2], const __be32 ts[2], __be16 error_est)
+{
+	__u64 ntp = stamp_ts64(bpf_ntohl(ts[0]), bpf_ntohl(ts[1]));
+
+	if (bpf_ntohs(error_est) & STAMP_ERR_EST_Z)
+		ntp = stamp_ns_to_ntp(stamp_ptp_to_ns(ntp));
+	dst[0] = ntp >> 32;
+	dst[1] = (__u32)ntp;
+}
 
+static __always_inline void store_stamp_data(struct stamp_data *data, struct stamp_reply_pkt *stamp_pkt, __u16 vlan,
+					     __u64 reply_rx, __u32 rx_clock)
+{
+	data->ssid = bpf_ntohs(stamp_pkt->ssid);
+	data->vlan = vlan;
+	data->seq = bpf_ntohl(stamp_pkt->seq);
+	store_ntp(data->test_tx, stamp_pkt->sender_tx_timestamp, stamp_pkt->sender_error_est);
+	store_ntp(data->test_rx, stamp_pkt->rx_timestamp, stamp_pkt->error_est);
+	store_ntp(data->reply_tx, stamp_pkt->tx_timestamp, stamp_pkt->error_est);
+	data->reply_rx = reply_rx;
+	data->rx_clock = rx_clock;
+	data->reserved = 0;
+}
+
+/* Shared ring mode: all CPUs write to stamp_data_map through one counter */
+static __always_inline int collect_shared(struct stamp_reply_pkt *stamp_pkt, __u16 vlan,
+					  __u64 reply_rx, __u32 rx_clock)
+{
+	struct stamp_data *temp_data;
+	__u64 *counter;
+	__u32 counter_map_key = COUNTER_KEY;
+	__u32 index;
 
 	/* Get BPF map */
 	counter = bpf_map_lookup_elem(&counter_map, &counter_map_key);
@@ -120,7 +406,11 @@ int  stamp_collector(struct xdp_md *ctx)
 		return XDP_PASS;
 	}
 
-	temp_data = bpf_map_lookup_elem(&stamp_data_map, counter);	
+	/* The counter keeps counting past the map size, so userspace can tell
+	 * how many samples were written since it last looked
+	 */
+	index = *counter % STAMP_MAP_SIZE;
+	temp_data = bpf_map_lookup_elem(&stamp_data_map, &index);	
 	if (!temp_data){
 		bpf_printk("Fail to look up stamp_data_map");
 		return XDP_PASS;
@@ -128,30 +418,215 @@ int  stamp_collector(struct xdp_md *ctx)
 
 
 	/* Extract and store STAMP packet data */
-	temp_data->ssid = bpf_ntohs(stamp_pkt->ssid);
-	temp_data->seq = bpf_ntohs(stamp_pkt->seq);
-	temp_data->test_tx[0] = bpf_ntohl(stamp_pkt->sender_tx_timestamp[0]);
-	temp_data->test_tx[1] = bpf_ntohl(stamp_pkt->sender_tx_timestamp[1]);
-	temp_data->test_rx[0] = bpf_ntohl(stamp_pkt->rx_timestamp[0]);
-	temp_data->test_rx[1] = bpf_ntohl(stamp_pkt->rx_timestamp[1]);
-	temp_data->reply_tx[0] = bpf_ntohl(stamp_pkt->tx_timestamp[0]);
-	temp_data->reply_tx[1] = bpf_ntohl(stamp_pkt->tx_timestamp[1]);
-	temp_data->reply_rx = bpf_ktime_get_ns();
+	store_stamp_data(temp_data, stamp_pkt, vlan, reply_rx, rx_clock);
 
 	
 	// bpf_printk("counter: %u, ssid: %u, seq: %u", *counter, temp_data->ssid, temp_data->seq);
 	
 
 	/* Increment counter */
-	if (*counter + 1 >= STAMP_MAP_SIZE){
-		*counter = 0;
+	*counter += 1;
+
+	return XDP_DROP;
+}
+
+/* Per-CPU ring mode: every CPU owns a contiguous segment of stamp_data_map
+ * and advances its own head index, so replies spread over several RX queues
+ * never race for the same slot. Segments are merged by userspace.
+ */
+static __always_inline int collect_percpu(struct stamp_reply_pkt *stamp_pkt, __u16 vlan,
+					  __u64 reply_rx, __u32 rx_clock)
+{
+	struct stamp_data *temp_data;
+	__u64 *head;
+	__u32 head_key = PERCPU_HEAD_KEY;
+	__u32 index;
+
+	/* Set by the loader in this mode, never 0 */
+	if (!seg_size)
+		return XDP_PASS;
+	head = bpf_map_lookup_elem(&percpu_counter_map, &head_key);
+	if (!head){
+		bpf_printk("Fail to look up percpu_counter_map");
+		return XDP_PASS;
 	}
-	else{
-		*counter += 1;
+
+	index = bpf_get_smp_processor_id() * seg_size + (__u32)(*head % seg_size);
+	temp_data = bpf_map_lookup_elem(&stamp_data_map, &index);
+	if (!temp_data){
+		bpf_printk("Fail to look up stamp_data_map");
+		return XDP_PASS;
+	}
+
+	store_stamp_data(temp_data, stamp_pkt, vlan, reply_rx, rx_clock);
+
+	/* Only this CPU touches its head, no atomic operation needed. The head
+	 * keeps counting past the segment size so userspace can tell whether
+	 * the segment wrapped.
+	 */
+	*head += 1;
+
+	return XDP_DROP;
+}
+
+/* Ring buffer mode: every sample is committed to stamp_ringbuf and streamed
+ * to userspace while the experiment runs, so nothing is overwritten on wrap.
+ */
+static __always_inline int collect_ringbuf(struct stamp_reply_pkt *stamp_pkt, __u16 vlan,
+					  __u64 reply_rx, __u32 rx_clock)
+{
+	struct stamp_data *temp_data;
+	__u32 drop_key = RINGBUF_DROP_KEY;
+	__u64 *drops;
+
+	temp_data = bpf_ringbuf_reserve(&stamp_ringbuf, sizeof(*temp_data), 0);
+	if (!temp_data){
+		/* Consumer is falling behind, account for the lost sample */
+		drops = bpf_map_lookup_elem(&percpu_counter_map, &drop_key);
+		if (drops)
+			*drops += 1;
+		return XDP_PASS;
+	}
+
+	store_stamp_data(temp_data, stamp_pkt, vlan, reply_rx, rx_clock);
+	bpf_ringbuf_submit(temp_data, 0);
+
+	return XDP_DROP;
+}
+
+/* Histogram mode: no raw samples are kept, the round-trip and reflector
+ * residence times are bucketed into per-SSID histograms right away.
+ */
+static __always_inline int collect_hist(struct stamp_reply_pkt *stamp_pkt, __u16 vlan,
+					  __u64 reply_rx, __u32 rx_clock)
+{
+	struct stamp_hist *hist;
+	__u64 test_tx, test_rx, reply_tx;
+	__s64 *clock_offset;
+	__u32 zero_key = 0, offset_key = CLOCK_OFFSET_MONO;
+	struct session_key key = {};
+
+	clock_offset = bpf_map_lookup_elem(&clock_offset_map, &offset_key);
+	if (!clock_offset){
+		bpf_printk("Fail to look up clock_offset_map");
+		return XDP_PASS;
+	}
+
+	key.ssid = bpf_ntohs(stamp_pkt->ssid);
+	key.vlan = vlan;
+	hist = bpf_map_lookup_elem(&stamp_hist_map, &key);
+	if (!hist){
+		struct stamp_hist *zero = bpf_map_lookup_elem(&hist_zero_map, &zero_key);
+
+		if (!zero)
+			return XDP_PASS;
+		/* Another CPU may have created the entry meanwhile, that is fine */
+		bpf_map_update_elem(&stamp_hist_map, &key, zero, BPF_NOEXIST);
+		hist = bpf_map_lookup_elem(&stamp_hist_map, &key);
+		if (!hist){
+			bpf_printk("Fail to look up stamp_hist_map");
+			return XDP_PASS;
+		}
 	}
 
+	/* All timestamps in ns since the Unix epoch */
+	test_tx = pkt_ts_to_ns(stamp_pkt->sender_tx_timestamp, stamp_pkt->sender_error_est);
+	test_rx = pkt_ts_to_ns(stamp_pkt->rx_timestamp, stamp_pkt->error_est);
+	reply_tx = pkt_ts_to_ns(stamp_pkt->tx_timestamp, stamp_pkt->error_est);
+	if (rx_clock == RX_CLOCK_KERNEL)
+		reply_rx = stamp_ktime_to_ns(reply_rx, *clock_offset);
+
+	/* Per-CPU entry, safe to update without atomic operations */
+	hist_record(hist, HIST_RTT, stamp_delta_ns(reply_rx, test_tx) - stamp_delta_ns(reply_tx, test_rx));
+	hist_record(hist, HIST_RESIDENCE, stamp_delta_ns(reply_tx, test_rx));
+
 	return XDP_DROP;
 }
 
+/* Common to the XDP and tc entry points, returns an XDP action */
+static __always_inline int handle_stamp_reply(struct stamp_reply_pkt *stamp_pkt, __u16 vlan,
+					      __u64 reply_rx, __u32 rx_clock)
+{
+	if (seq_tracking)
+		track_seq(stamp_pkt, vlan);
+
+	/* collect_mode is constant after load, only one branch survives */
+	switch (collect_mode){
+	case COLLECT_PERCPU:
+		return collect_percpu(stamp_pkt, vlan, reply_rx, rx_clock);
+	case COLLECT_RINGBUF:
+		return collect_ringbuf(stamp_pkt, vlan, reply_rx, rx_clock);
+	case COLLECT_HIST:
+		return collect_hist(stamp_pkt, vlan, reply_rx, rx_clock);
+	default:
+		return collect_shared(stamp_pkt, vlan, reply_rx, rx_clock);
+	}
+}
+
+SEC("xdp")
+int  stamp_collector(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct hdr_cursor nh; /* These keep track of the next header type and iterator pointer */
+	struct collect_vlans vlans = {};
+	struct stamp_reply_pkt *stamp_pkt;
+	__u64 reply_rx;
+	__u32 rx_clock;
+
+	nh.pos = data;
+	
+	stamp_pkt = is_stamp_packet(&nh, data_end, &vlans);
+	if (!stamp_pkt){
+		return XDP_PASS;
+	}
+
+	// bpf_printk("Verified STAMP packet");
+
+	/* Timestamp before taking the sequence tracking lock */
+	reply_rx = get_reply_rx(ctx, &rx_clock);
+
+	return handle_stamp_reply(stamp_pkt, vlans.id[0], reply_rx, rx_clock);
+}
+
+/* tc (clsact ingress) variant for drivers with poor native XDP support.
+ * RX metadata kfuncs are XDP only, reply_rx always uses the kernel clock.
+ */
+SEC("tc")
+int  stamp_collector_tc(struct __sk_buff *skb)
+{
+	void *data_end;
+	void *data;
+	struct hdr_cursor nh;
+	struct collect_vlans vlans = {};
+	struct stamp_reply_pkt *stamp_pkt;
+	__u32 pull_len = skb->len < STAMP_TC_PULL_LEN ? skb->len : STAMP_TC_PULL_LEN;
+	__u32 rx_clock;
+	__u64 reply_rx;
+	__u16 vlan;
+
+	/* Headers and STAMP payload must be in the linear part of the skb */
+	if ((void *)(long)skb->data + pull_len > (void *)(long)skb->data_end)
+		bpf_skb_pull_data(skb, pull_len);
+	data_end = (void *)(long)skb->data_end;
+	data = (void *)(long)skb->data;
+	nh.pos = data;
+
+	stamp_pkt = is_stamp_packet(&nh, data_end, &vlans);
+	if (!stamp_pkt){
+		return TC_ACT_OK;
+	}
+
+	/* The outer tag may have been stripped by VLAN offload */
+	vlan = vlans.id[0];
+	if (skb->vlan_present)
+		vlan = skb->vlan_tci & VLAN_VID_MASK;
+
+	reply_rx = get_kernel_rx(&rx_clock);
+	if (handle_stamp_reply(stamp_pkt, vlan, reply_rx, rx_clock) == XDP_DROP)
+		return TC_ACT_SHOT;
+	return TC_ACT_OK;
+}
+
 /* SPDX-License-Identifier: GPL-2.0 */
 char _license[] SEC("license") = "GPL";
\ No newline at end of file
@@ -0,0 +1,382 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Minimal HTTP listener serving the collector counters in the OpenMetrics
+ * text format on GET /metrics. Every scrape reads the BPF maps directly, so
+ * it sees the kernel counters as of now, independently of when samples are
+ * drained to the output file. Connections are served one at a time on a
+ * thread of their own.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "collector_metrics.h"
+#include "collector_stats.h"
+
+#define METRICS_POLL_MS		100
+#define METRICS_TIMEOUT_MS	1000
+#define METRICS_REQUEST_MAX	4096
+
+#define OPENMETRICS_CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+struct metrics_server {
+	struct metrics_source src;
+	int listen_fd;
+	pthread_t thread;
+	volatile bool stopping;
+};
+
+static __u64 sum_percpu(int map_fd, __u32 key){
+	int nr_cpus = libbpf_num_possible_cpus();
+	__u64 values[nr_cpus];
+	__u64 sum = 0;
+
+	if (bpf_map_lookup_elem(map_fd, &key, values) != 0)
+		return 0;
+	for (int cpu = 0; cpu < nr_cpus; cpu++)
+		sum += values[cpu];
+	return sum;
+}
+
+/* Counters of the whole collector */
+static void write_global(FILE *out, const struct metrics_source *src){
+	__u32 key = COUNTER_KEY;
+	__u64 samples = 0;
+
+	if (src->mode == COLLECT_SHARED || src->mode == COLLECT_PERCPU) {
+		if (src->mode == COLLECT_PERCPU)
+			samples = sum_percpu(src->percpu_counter_fd, PERCPU_HEAD_KEY);
+		else if (bpf_map_lookup_elem(src->counter_fd, &key, &samples) != 0)
+			samples = 0;
+		fprintf(out, "# TYPE stamp_samples counter\n"
+			"# HELP stamp_samples Samples written to stamp_data_map.\n"
+			"stamp_samples_total %llu\n", (unsigned long long)samples);
+	}
+	if (src->mode == COLLECT_RINGBUF) {
+		fprintf(out, "# TYPE stamp_ringbuf_dropped counter\n"
+			"# HELP stamp_ringbuf_dropped Samples lost to a full ring buffer.\n"
+			"stamp_ringbuf_dropped_total %llu\n",
+			(unsigned long long)sum_percpu(src->percpu_counter_fd, RINGBUF_DROP_KEY));
+	}
+	fprintf(out, "# TYPE stamp_rx_timestamp_fallback counter\n"
+		"# HELP stamp_rx_timestamp_fallback Replies without a HW RX timestamp.\n"
+		"stamp_rx_timestamp_fallback_total %llu\n",
+		(unsigned long long)sum_percpu(src->percpu_counter_fd, RX_TS_FALLBACK_KEY));
+	fprintf(out, "# TYPE stamp_clock_fallback counter\n"
+		"# HELP stamp_clock_fallback Replies taken before the clock offsets were written.\n"
+		"stamp_clock_fallback_total %llu\n",
+		(unsigned long long)sum_percpu(src->percpu_counter_fd, CLOCK_FALLBACK_KEY));
+}
+
+/* One counter family per field of struct seq_counters, by session */
+static void write_seq(FILE *out, int seq_map_fd){
+	static const struct {
+		const char *name;
+		const char *help;
+	} families[] = {
+		{ "stamp_replies", "Replies received." },
+		{ "stamp_lost", "Replies lost, late replies excluded." },
+		{ "stamp_duplicate", "Duplicate replies." },
+		{ "stamp_reordered", "Reordered replies." },
+		{ "stamp_late", "Replies received after leaving the window." },
+	};
+	struct session_key key, next_key, *prev_key;
+	struct seq_state state;
+	unsigned int f;
+	__u64 value;
+
+	for (f = 0; f < sizeof(families) / sizeof(families[0]); f++) {
+		fprintf(out, "# TYPE %s counter\n# HELP %s %s\n",
+			families[f].name, families[f].name, families[f].help);
+
+		prev_key = NULL;
+		while (bpf_map_get_next_key(seq_map_fd, prev_key, &next_key) == 0) {
+			key = next_key;
+			prev_key = &key;
+			if (bpf_map_lookup_elem_flags(seq_map_fd, &key, &state, BPF_F_LOCK) != 0)
+				continue;
+
+			struct seq_counters *c = &state.counters;
+			switch (f) {
+			case 0: value = c->received; break;
+			case 1: value = c->lost > c->late ? c->lost - c->late : 0; break;
+			case 2: value = c->duplicate; break;
+			case 3: value = c->reordered; break;
+			default: value = c->late; break;
+			}
+			fprintf(out, "%s_total{ssid=\"%u\",vlan=\"%u\"} %llu\n", families[f].name,
+				key.ssid, key.vlan, (unsigned long long)value);
+		}
+	}
+}
+
+/* Merge the per-CPU values of one session of stamp_hist_map */
+static int lookup_hist(int hist_map_fd, const struct session_key *key, struct stamp_hist *values,
+		       int nr_cpus, struct stamp_hist *merged){
+	if (bpf_map_lookup_elem(hist_map_fd, key, values) != 0)
+		return -1;
+	hist_merge(merged, values, nr_cpus);
+	return 0;
+}
+
+/*
+ * Histograms of the hist mode, merged over all CPUs. Exporting all
+ * HIST_BUCKETS buckets of every session would make scrapes huge, so every
+ * power of two (HIST_SUB_BUCKETS buckets) becomes one OpenMetrics bucket.
+ * OpenMetrics bounds are inclusive, so le is the largest value of the group,
+ * 1 ns below the first one of the next. The overflow bucket is only in +Inf,
+ * which is the count. The samples of a metric family must
+ * be contiguous, so the map is walked once per family.
+ */
+static void write_hist(FILE *out, int hist_map_fd){
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct session_key key, next_key, *prev_key;
+	struct stamp_hist *values, merged;
+	__u32 groups = HIST_OVERFLOW_BUCKET / HIST_SUB_BUCKETS;
+	const char *name;
+	__u64 cumulative;
+	int m, negative;
+
+	values = calloc(nr_cpus, sizeof(*values));
+	if (!values)
+		return;
+
+	for (m = 0; m < HIST_METRICS; m++) {
+		name = hist_metric_names[m];
+		for (negative = 0; negative <= 1; negative++) {
+			if (negative)
+				fprintf(out, "# TYPE stamp_%s_negative counter\n"
+					"# HELP stamp_%s_negative Values below zero, clocks out of sync.\n",
+					name, name);
+			else
+				fprintf(out, "# TYPE stamp_%s_seconds histogram\n"
+					"# UNIT stamp_%s_seconds seconds\n", name, name);
+
+			prev_key = NULL;
+			while (bpf_map_get_next_key(hist_map_fd, prev_key, &next_key) == 0) {
+				key = next_key;
+				prev_key = &key;
+				if (lookup_hist(hist_map_fd, &key, values, nr_cpus, &merged) != 0)
+					continue;
+
+				if (negative) {
+					fprintf(out, "stamp_%s_negative_total{ssid=\"%u\",vlan=\"%u\"} %llu\n",
+						name, key.ssid, key.vlan,
+						(unsigned long long)merged.negative[m]);
+					continue;
+				}
+
+				cumulative = 0;
+				for (__u32 g = 0; g < groups; g++) {
+					for (__u32 b = g * HIST_SUB_BUCKETS; b < (g + 1) * HIST_SUB_BUCKETS; b++)
+						cumulative += merged.bucket[m][b];
+					fprintf(out, "stamp_%s_seconds_bucket{ssid=\"%u\",vlan=\"%u\",le=\"%.9f\"} %llu\n",
+						name, key.ssid, key.vlan,
+						(hist_bucket_low((g + 1) * HIST_SUB_BUCKETS) - 1) / 1e9,
+						(unsigned long long)cumulative);
+				}
+				fprintf(out, "stamp_%s_seconds_bucket{ssid=\"%u\",vlan=\"%u\",le=\"+Inf\"} %llu\n"
+					"stamp_%s_seconds_count{ssid=\"%u\",vlan=\"%u\"} %llu\n"
+					"stamp_%s_seconds_sum{ssid=\"%u\",vlan=\"%u\"} %.9f\n",
+					name, key.ssid, key.vlan, (unsigned long long)merged.count[m],
+					name, key.ssid, key.vlan, (unsigned long long)merged.count[m],
+					name, key.ssid, key.vlan, merged.sum_ns[m] / 1e9);
+			}
+		}
+	}
+	free(values);
+}
+
+/* The OpenMetrics exposition of every map, malloc'ed into *body */
+static int render_metrics(const struct metrics_source *src, char **body, size_t *len){
+	FILE *out = open_memstream(body, len);
+
+	if (!out)
+		return -errno;
+	write_global(out, src);
+	if (src->seq_map_fd >= 0)
+		write_seq(out, src->seq_map_fd);
+	if (src->hist_map_fd >= 0)
+		write_hist(out, src->hist_map_fd);
+	fprintf(out, "# EOF\n");
+	if (fclose(out) != 0)
+		return -EIO;
+	return 0;
+}
+
+static int send_all(int fd, const char *buf, size_t len){
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void send_response(int fd, const char *status, const char *type, const char *body, size_t len){
+	char header[256];
+	int n;
+
+	n = snprintf(header, sizeof(header),
+		     "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+		     status, type, len);
+	if (send_all(fd, header, n) == 0)
+		send_all(fd, body, len);
+}
+
+/* Read one request and answer it, GET /metrics is the only resource */
+static void serve_client(struct metrics_server *srv, int fd){
+	struct timeval timeout = { .tv_sec = METRICS_TIMEOUT_MS / 1000 };
+	char req[METRICS_REQUEST_MAX + 1];
+	size_t len = 0;
+	ssize_t n;
+	char *body;
+	size_t body_len;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	/* Only the request line matters, but wait for the end of the headers */
+	while (len < METRICS_REQUEST_MAX) {
+		n = recv(fd, req + len, METRICS_REQUEST_MAX - len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		len += n;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n"))
+			break;
+	}
+	req[len] = '\0';
+
+	if (strncmp(req, "GET ", 4) != 0) {
+		send_response(fd, "405 Method Not Allowed", "text/plain", "", 0);
+		return;
+	}
+	if (strncmp(req + 4, "/metrics ", 9) != 0 && strncmp(req + 4, "/metrics?", 9) != 0) {
+		send_response(fd, "404 Not Found", "text/plain", "", 0);
+		return;
+	}
+	if (render_metrics(&srv->src, &body, &body_len) != 0) {
+		send_response(fd, "500 Internal Server Error", "text/plain", "", 0);
+		return;
+	}
+	send_response(fd, "200 OK", OPENMETRICS_CONTENT_TYPE, body, body_len);
+	free(body);
+}
+
+static void *metrics_main(void *arg){
+	struct metrics_server *srv = arg;
+	struct pollfd pfd = { .fd = srv->listen_fd, .events = POLLIN };
+	int fd;
+
+	while (!srv->stopping) {
+		if (poll(&pfd, 1, METRICS_POLL_MS) <= 0)
+			continue;
+		fd = accept(srv->listen_fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		serve_client(srv, fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+/* Parse <port> (loopback) or <ipv4-addr>:<port> */
+static int parse_listen_addr(const char *listen_addr, struct sockaddr_in *sin){
+	const char *colon = strrchr(listen_addr, ':');
+	const char *port = colon ? colon + 1 : listen_addr;
+	char addr[INET_ADDRSTRLEN];
+	char *end;
+	long p;
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	/* Port 0 picks a free port, see metrics_port() */
+	p = strtol(port, &end, 10);
+	if (*port == '\0' || *end != '\0' || p < 0 || p > 65535)
+		return -EINVAL;
+	sin->sin_port = htons(p);
+
+	if (colon) {
+		if ((size_t)(colon - listen_addr) >= sizeof(addr))
+			return -EINVAL;
+		memcpy(addr, listen_addr, colon - listen_addr);
+		addr[colon - listen_addr] = '\0';
+		if (inet_pton(AF_INET, addr, &sin->sin_addr) != 1)
+			return -EINVAL;
+	}
+	return 0;
+}
+
+/* Listen on listen_addr and serve the maps of src until metrics_stop() */
+struct metrics_server *metrics_start(const char *listen_addr, const struct metrics_source *src){
+	struct metrics_server *srv;
+	struct sockaddr_in sin;
+	int one = 1;
+
+	if (parse_listen_addr(listen_addr, &sin) != 0) {
+		fprintf(stderr, "ERR: invalid --metrics address %s\n", listen_addr);
+		return NULL;
+	}
+
+	srv = calloc(1, sizeof(*srv));
+	if (!srv)
+		return NULL;
+	srv->src = *src;
+	srv->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (srv->listen_fd < 0)
+		goto err;
+	setsockopt(srv->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(srv->listen_fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+	    listen(srv->listen_fd, 16) != 0) {
+		fprintf(stderr, "ERR: listening on %s: %s\n", listen_addr, strerror(errno));
+		goto err;
+	}
+	if (pthread_create(&srv->thread, NULL, metrics_main, srv) != 0)
+		goto err;
+	return srv;
+
+err:
+	if (srv->listen_fd >= 0)
+		close(srv->listen_fd);
+	free(srv);
+	return NULL;
+}
+
+/* The port the server listens on */
+int metrics_port(const struct metrics_server *srv){
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+
+	if (getsockname(srv->listen_fd, (struct sockaddr *)&sin, &len) != 0)
+		return -errno;
+	return ntohs(sin.sin_port);
+}
+
+void metrics_stop(struct metrics_server *srv){
+	srv->stopping = true;
+	pthread_join(srv->thread, NULL);
+	close(srv->listen_fd);
+	free(srv);
+}
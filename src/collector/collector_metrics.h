@@ -0,0 +1,24 @@
+/* OpenMetrics exporter of the collector maps, see collector_metrics.c */
+#ifndef COLLECTOR_METRICS_H
+#define COLLECTOR_METRICS_H
+
+#include <linux/types.h>
+
+#include "collector.h"
+
+/* Maps read at scrape time, -1 if not used in this mode */
+struct metrics_source {
+	__u8 mode;			/* enum collect_mode */
+	int seq_map_fd;
+	int counter_fd;
+	int percpu_counter_fd;
+	int hist_map_fd;
+};
+
+struct metrics_server;
+
+struct metrics_server *metrics_start(const char *listen_addr, const struct metrics_source *src);
+int metrics_port(const struct metrics_server *srv);
+void metrics_stop(struct metrics_server *srv);
+
+#endif /* COLLECTOR_METRICS_H */
@@ -0,0 +1,291 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Loopback scrape of the OpenMetrics exporter, run with "make test". The
+ * maps are created here and filled with known values, a scrape must parse
+ * and report exactly those. Needs CAP_BPF to create the maps.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "collector_metrics.h"
+
+#define SCRAPE_MAX	(1 << 20)
+
+static int failures;
+
+#define CHECK(cond, ...) do {					\
+	if (!(cond)) {						\
+		fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);	\
+		fprintf(stderr, __VA_ARGS__);			\
+		fprintf(stderr, "\n");				\
+		failures++;					\
+	}							\
+} while (0)
+
+/* GET /metrics on the loopback port, the body malloc'ed into *body */
+static int scrape(int port, char **body){
+	static const char request[] = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	char *buf, *start;
+	size_t len = 0;
+	ssize_t n;
+	int fd;
+
+	buf = malloc(SCRAPE_MAX + 1);
+	if (!buf)
+		return -ENOMEM;
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+	    send(fd, request, sizeof(request) - 1, 0) != sizeof(request) - 1) {
+		perror("scrape");
+		goto err;
+	}
+	/* The server closes the connection after the response */
+	while (len < SCRAPE_MAX && (n = recv(fd, buf + len, SCRAPE_MAX - len, 0)) > 0)
+		len += n;
+	buf[len] = '\0';
+	close(fd);
+
+	CHECK(strncmp(buf, "HTTP/1.1 200 OK\r\n", 17) == 0, "status: %.40s", buf);
+	CHECK(strstr(buf, "Content-Type: application/openmetrics-text"), "content type");
+	start = strstr(buf, "\r\n\r\n");
+	if (!start)
+		goto err;
+	*body = strdup(start + 4);
+	free(buf);
+	return *body ? 0 : -ENOMEM;
+
+err:
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	return -1;
+}
+
+/* Every line is a descriptor, a sample <name>[{<labels>}] <value> or the
+ * final # EOF
+ */
+static void check_syntax(const char *body){
+	const char *line = body, *p, *eol;
+	char *end;
+
+	while (*line) {
+		eol = strchr(line, '\n');
+		CHECK(eol, "unterminated line: %s", line);
+		if (!eol)
+			return;
+		if (strncmp(line, "# EOF\n", 6) == 0) {
+			CHECK(eol[1] == '\0', "text after # EOF");
+			return;
+		}
+		if (strncmp(line, "# TYPE ", 7) == 0 || strncmp(line, "# HELP ", 7) == 0 ||
+		    strncmp(line, "# UNIT ", 7) == 0) {
+			line = eol + 1;
+			continue;
+		}
+
+		p = line;
+		CHECK(isalpha(*p) || *p == '_', "metric name: %.*s", (int)(eol - line), line);
+		while (isalnum(*p) || *p == '_' || *p == ':')
+			p++;
+		if (*p == '{') {
+			/* label="value" pairs, values without quotes or escapes */
+			while (*p != '}' && p < eol) {
+				p++;
+				while (isalnum(*p) || *p == '_')
+					p++;
+				CHECK(p[0] == '=' && p[1] == '"', "label: %.*s", (int)(eol - line), line);
+				p = memchr(p + 2, '"', eol - p - 2);
+				if (!p)
+					break;
+				p++;
+				CHECK(*p == ',' || *p == '}', "labels: %.*s", (int)(eol - line), line);
+			}
+			if (!p || p >= eol)
+				p = eol;
+			else
+				p++;
+		}
+		CHECK(*p == ' ', "no value: %.*s", (int)(eol - line), line);
+		if (*p == ' ') {
+			strtod(p + 1, &end);
+			CHECK(end == eol, "value: %.*s", (int)(eol - line), line);
+		}
+		line = eol + 1;
+	}
+	CHECK(0, "no # EOF");
+}
+
+/* Value of the sample named exactly series (with its labels), -1 if absent */
+static double sample_value(const char *body, const char *series){
+	size_t len = strlen(series);
+	const char *line = body;
+
+	while (line && *line) {
+		if (strncmp(line, series, len) == 0 && line[len] == ' ')
+			return strtod(line + len + 1, NULL);
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+	}
+	return -1;
+}
+
+static int create_array(enum bpf_map_type type, __u32 value_size, __u32 max_entries){
+	return bpf_map_create(type, NULL, sizeof(__u32), value_size, max_entries, NULL);
+}
+
+/* Serve src on a free loopback port and scrape it once */
+static char *serve_and_scrape(const struct metrics_source *src){
+	struct metrics_server *srv;
+	char *body = NULL;
+	int port;
+
+	srv = metrics_start("127.0.0.1:0", src);
+	CHECK(srv, "metrics_start");
+	if (!srv)
+		return NULL;
+	port = metrics_port(srv);
+	CHECK(port > 0, "metrics_port %d", port);
+	if (port <= 0 || scrape(port, &body) != 0)
+		body = NULL;
+	metrics_stop(srv);
+	if (body)
+		check_syntax(body);
+	return body;
+}
+
+/* The global counters of the shared mode */
+static void test_counters(int counter_fd, int percpu_counter_fd, int nr_cpus){
+	struct metrics_source src = {
+		.mode = COLLECT_SHARED,
+		.seq_map_fd = -1,
+		.counter_fd = counter_fd,
+		.percpu_counter_fd = percpu_counter_fd,
+		.hist_map_fd = -1,
+	};
+	__u64 samples = 123456789, values[nr_cpus], fallbacks = 0;
+	__u32 key = COUNTER_KEY;
+	char *body;
+
+	bpf_map_update_elem(counter_fd, &key, &samples, BPF_ANY);
+	for (int cpu = 0; cpu < nr_cpus; cpu++) {
+		values[cpu] = cpu + 1;
+		fallbacks += cpu + 1;
+	}
+	key = RX_TS_FALLBACK_KEY;
+	bpf_map_update_elem(percpu_counter_fd, &key, values, BPF_ANY);
+
+	body = serve_and_scrape(&src);
+	if (!body)
+		return;
+	CHECK(sample_value(body, "stamp_samples_total") == samples, "stamp_samples_total");
+	CHECK(sample_value(body, "stamp_rx_timestamp_fallback_total") == fallbacks,
+	      "stamp_rx_timestamp_fallback_total");
+	free(body);
+}
+
+/* A hist mode histogram with samples on either side of a bucket bound */
+static void test_hist(int counter_fd, int percpu_counter_fd, int nr_cpus){
+	struct metrics_source src = {
+		.mode = COLLECT_HIST,
+		.seq_map_fd = -1,
+		.counter_fd = counter_fd,
+		.percpu_counter_fd = percpu_counter_fd,
+	};
+	struct session_key key = { .ssid = 7 };
+	__u64 bound = hist_bucket_low(10 * HIST_SUB_BUCKETS);	/* 8192 ns */
+	__u64 overflow = 1ULL << (HIST_MAX_LOG2 + 1);
+	__u64 last_le = hist_bucket_low(HIST_OVERFLOW_BUCKET) - 1;
+	struct stamp_hist *values;
+	char series[128];
+	char *body;
+
+	src.hist_map_fd = bpf_map_create(BPF_MAP_TYPE_PERCPU_HASH, NULL, sizeof(key),
+					 sizeof(struct stamp_hist), 1, NULL);
+	values = calloc(nr_cpus, sizeof(*values));
+	CHECK(src.hist_map_fd >= 0 && values, "hist map");
+	if (src.hist_map_fd < 0 || !values)
+		goto out;
+
+	/* Split over two CPUs, the scrape merges them */
+	values[0].count[HIST_RTT] = 1;
+	values[0].sum_ns[HIST_RTT] = bound - 1;
+	values[0].bucket[HIST_RTT][hist_bucket(bound - 1)] = 1;
+	values[nr_cpus - 1].count[HIST_RTT] += 1;
+	values[nr_cpus - 1].sum_ns[HIST_RTT] += bound;
+	values[nr_cpus - 1].bucket[HIST_RTT][hist_bucket(bound)] += 1;
+	values[nr_cpus - 1].negative[HIST_RTT] += 3;
+	/* Beyond the last finite bound, only counted in +Inf */
+	values[0].count[HIST_RTT] += 1;
+	values[0].sum_ns[HIST_RTT] += overflow;
+	values[0].bucket[HIST_RTT][hist_bucket(overflow)] += 1;
+	bpf_map_update_elem(src.hist_map_fd, &key, values, BPF_ANY);
+
+	body = serve_and_scrape(&src);
+	if (!body)
+		goto out;
+	/* le is inclusive: bound - 1 is in the bucket ending there, bound not */
+	snprintf(series, sizeof(series),
+		 "stamp_rtt_seconds_bucket{ssid=\"7\",vlan=\"0\",le=\"%.9f\"}", (bound - 1) / 1e9);
+	CHECK(sample_value(body, series) == 1, "%s", series);
+	snprintf(series, sizeof(series),
+		 "stamp_rtt_seconds_bucket{ssid=\"7\",vlan=\"0\",le=\"%.9f\"}", (2 * bound - 1) / 1e9);
+	CHECK(sample_value(body, series) == 2, "%s", series);
+	snprintf(series, sizeof(series),
+		 "stamp_rtt_seconds_bucket{ssid=\"7\",vlan=\"0\",le=\"%.9f\"}", last_le / 1e9);
+	CHECK(sample_value(body, series) == 2, "%s", series);
+	CHECK(sample_value(body, "stamp_rtt_seconds_bucket{ssid=\"7\",vlan=\"0\",le=\"+Inf\"}") == 3,
+	      "+Inf bucket");
+	CHECK(sample_value(body, "stamp_rtt_seconds_count{ssid=\"7\",vlan=\"0\"}") == 3, "count");
+	CHECK(sample_value(body, "stamp_rtt_seconds_sum{ssid=\"7\",vlan=\"0\"}") ==
+	      (2 * bound - 1 + overflow) / 1e9, "sum");
+	CHECK(sample_value(body, "stamp_rtt_negative_total{ssid=\"7\",vlan=\"0\"}") == 3, "negative");
+	CHECK(sample_value(body, "stamp_residence_seconds_count{ssid=\"7\",vlan=\"0\"}") == 0,
+	      "residence count");
+	free(body);
+
+out:
+	free(values);
+	if (src.hist_map_fd >= 0)
+		close(src.hist_map_fd);
+}
+
+int main(void)
+{
+	int nr_cpus = libbpf_num_possible_cpus();
+	int counter_fd, percpu_counter_fd;
+
+	counter_fd = create_array(BPF_MAP_TYPE_ARRAY, sizeof(__u64), COUNTER_MAP_SIZE);
+	percpu_counter_fd = create_array(BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(__u64),
+					 PERCPU_COUNTER_MAP_SIZE);
+	if (counter_fd < 0 || percpu_counter_fd < 0) {
+		if (errno == EPERM) {
+			printf("SKIP collector_metrics_test: creating BPF maps needs CAP_BPF\n");
+			return 0;
+		}
+		perror("bpf_map_create");
+		return 1;
+	}
+
+	test_counters(counter_fd, percpu_counter_fd, nr_cpus);
+	test_hist(counter_fd, percpu_counter_fd, nr_cpus);
+
+	close(counter_fd);
+	close(percpu_counter_fd);
+	printf("%s collector_metrics_test\n", failures ? "FAIL" : "PASS");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,319 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Bounded pipeline between the thread draining the data map (the reader)
+ * and the output file:
+ *
+ *   reader --batches--> N workers (encode_samples) --> writer thread
+ *
+ * Batches live in a ring of slots and are numbered in the order they are
+ * submitted. Workers encode any submitted batch, the writer thread writes
+ * them out strictly by number, so the output is the same as with a single
+ * thread. The reader blocks in pipeline_next_batch() while every slot is
+ * in use, or with a write queue gets no batch, so a slow disk does not stall
+ * draining.
+ */
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "collector_pipeline.h"
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_FILLING,		/* Reader is filling the samples */
+	SLOT_SUBMITTED,
+	SLOT_ENCODING,
+	SLOT_ENCODED,
+};
+
+struct pipeline_slot {
+	enum slot_state state;
+	struct stamp_data *samples;	/* PIPELINE_BATCH samples */
+	__u32 count;
+	void *out;			/* Encoded batch */
+	size_t len;
+	__u32 valid;
+};
+
+struct pipeline {
+	struct sample_writer *writer;
+	int nr_workers;
+	int nr_slots;
+	bool drop_when_full;		/* Started with a write queue */
+	struct pipeline_slot *slots;
+	pthread_t *workers;
+	pthread_t writer_thread;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/* Any slot changed state */
+	__u64 next_fill;		/* Batch the reader fills next */
+	__u64 next_encode;		/* Oldest batch no worker picked up */
+	__u64 next_write;		/* Batch the writer thread waits for */
+	__u64 saved;			/* Valid samples written */
+	int err;			/* First write error */
+	bool stopping;
+};
+
+static struct pipeline_slot *slot_of(struct pipeline *p, __u64 batch){
+	return &p->slots[batch % p->nr_slots];
+}
+
+static void *worker_main(void *arg){
+	struct pipeline *p = arg;
+	struct sample_writer *w = p->writer;
+	struct pipeline_slot *slot;
+
+	pthread_mutex_lock(&p->lock);
+	while (1) {
+		while (!p->stopping && (p->next_encode == p->next_fill ||
+					slot_of(p, p->next_encode)->state != SLOT_SUBMITTED))
+			pthread_cond_wait(&p->cond, &p->lock);
+		if (p->stopping)
+			break;
+
+		slot = slot_of(p, p->next_encode++);
+		slot->state = SLOT_ENCODING;
+		pthread_mutex_unlock(&p->lock);
+
+		slot->len = encode_samples(w->format, w->offset_ns, slot->samples, slot->count,
+					   slot->out, &slot->valid);
+
+		pthread_mutex_lock(&p->lock);
+		slot->state = SLOT_ENCODED;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/* Wait for a state change, or with timed segments until the open one ends
+ * (the condition variable uses CLOCK_REALTIME, as the segments do). Returns
+ * true if that time is up.
+ */
+static bool writer_wait(struct pipeline *p){
+	struct sample_writer *w = p->writer;
+	struct timespec end;
+
+	if (!w->rotate_ns || !w->fp) {
+		pthread_cond_wait(&p->cond, &p->lock);
+		return false;
+	}
+	end.tv_sec = w->segment_end_ns / NANOSEC_PER_SEC;
+	end.tv_nsec = w->segment_end_ns % NANOSEC_PER_SEC;
+	return pthread_cond_timedwait(&p->cond, &p->lock, &end) == ETIMEDOUT;
+}
+
+static void *writer_main(void *arg){
+	struct pipeline *p = arg;
+	struct pipeline_slot *slot;
+	bool idle;
+	int err;
+
+	pthread_mutex_lock(&p->lock);
+	while (1) {
+		while (!p->stopping && slot_of(p, p->next_write)->state != SLOT_ENCODED) {
+			if (!writer_wait(p))
+				continue;
+			/* No samples arrived until the segment ended, close it now */
+			pthread_mutex_unlock(&p->lock);
+			err = writer_rotate_due(p->writer);
+			pthread_mutex_lock(&p->lock);
+			if (err && !p->err)
+				p->err = err;
+		}
+		if (p->stopping)
+			break;
+
+		slot = slot_of(p, p->next_write);
+		pthread_mutex_unlock(&p->lock);
+
+		err = writer_write_encoded(p->writer, slot->out, slot->len);
+
+		pthread_mutex_lock(&p->lock);
+		idle = slot_of(p, p->next_write + 1)->state != SLOT_ENCODED;
+		pthread_mutex_unlock(&p->lock);
+		/* Hand what stdio still holds to the kernel before going idle */
+		if (!err && idle && p->writer->fp && fflush(p->writer->fp) != 0)
+			err = -EIO;
+
+		pthread_mutex_lock(&p->lock);
+		if (err && !p->err)
+			p->err = err;
+		p->saved += slot->valid;
+		slot->state = SLOT_FREE;
+		p->next_write++;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+static void free_pipeline(struct pipeline *p){
+	int i;
+
+	for (i = 0; i < p->nr_slots; i++) {
+		free(p->slots[i].samples);
+		free(p->slots[i].out);
+	}
+	free(p->slots);
+	free(p->workers);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+}
+
+/* Start nr_workers encoding threads and the writer thread, which write
+ * to writer. Nothing else may use writer until pipeline_stop(). With a
+ * queue of n > 0 batches, up to n batches wait for the workers and the
+ * disk, and pipeline_next_batch() returns NULL instead of blocking when
+ * they are all in use.
+ */
+struct pipeline *pipeline_start(struct sample_writer *writer, int nr_workers, int queue){
+	size_t out_size = stamp_encoded_size(writer->format, PIPELINE_BATCH);
+	struct pipeline *p;
+	int i, started;
+
+	if (nr_workers < 1 || nr_workers > PIPELINE_MAX_WORKERS)
+		return NULL;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+	p->writer = writer;
+	p->nr_workers = nr_workers;
+	/* Each worker can hold one batch while the reader fills another and
+	 * the writer thread writes a third.
+	 */
+	p->nr_slots = 2 * nr_workers + 2;
+	if (queue > 0) {
+		p->nr_slots = queue > p->nr_slots ? queue : p->nr_slots;
+		p->drop_when_full = true;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	p->slots = calloc(p->nr_slots, sizeof(*p->slots));
+	p->workers = calloc(nr_workers, sizeof(*p->workers));
+	if (!p->slots || !p->workers)
+		goto err;
+	for (i = 0; i < p->nr_slots; i++) {
+		p->slots[i].samples = malloc(PIPELINE_BATCH * sizeof(struct stamp_data));
+		p->slots[i].out = malloc(out_size);
+		if (!p->slots[i].samples || !p->slots[i].out)
+			goto err;
+	}
+
+	if (pthread_create(&p->writer_thread, NULL, writer_main, p) != 0)
+		goto err;
+	for (started = 0; started < nr_workers; started++) {
+		if (pthread_create(&p->workers[started], NULL, worker_main, p) != 0)
+			break;
+	}
+	if (started < nr_workers) {
+		/* Wind down the threads already running */
+		__u64 saved = 0;
+
+		p->nr_workers = started;
+		pipeline_stop(p, &saved);
+		return NULL;
+	}
+	return p;
+
+err:
+	free_pipeline(p);
+	return NULL;
+}
+
+/* Samples buffer of the next batch, blocks until a slot is free. Hand it to
+ * the workers with pipeline_submit(). With a write queue, returns NULL if
+ * no slot is free: the queue is full.
+ */
+struct stamp_data *pipeline_next_batch(struct pipeline *p){
+	struct pipeline_slot *slot;
+
+	pthread_mutex_lock(&p->lock);
+	slot = slot_of(p, p->next_fill);
+	while (slot->state != SLOT_FREE && slot->state != SLOT_FILLING) {
+		if (p->drop_when_full) {
+			pthread_mutex_unlock(&p->lock);
+			return NULL;
+		}
+		pthread_cond_wait(&p->cond, &p->lock);
+	}
+	slot->state = SLOT_FILLING;
+	pthread_mutex_unlock(&p->lock);
+	return slot->samples;
+}
+
+/* Submit the first count samples of the batch from pipeline_next_batch() */
+int pipeline_submit(struct pipeline *p, __u32 count){
+	struct pipeline_slot *slot;
+
+	if (count > PIPELINE_BATCH)
+		return -EINVAL;
+
+	pthread_mutex_lock(&p->lock);
+	slot = slot_of(p, p->next_fill);
+	if (slot->state != SLOT_FILLING) {
+		pthread_mutex_unlock(&p->lock);
+		return -EINVAL;
+	}
+	slot->count = count;
+	slot->state = SLOT_SUBMITTED;
+	p->next_fill++;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+/* Add the valid samples written since the last call to *saved without
+ * waiting, return the first write error since then.
+ */
+int pipeline_collect(struct pipeline *p, __u64 *saved){
+	int err;
+
+	pthread_mutex_lock(&p->lock);
+	*saved += p->saved;
+	p->saved = 0;
+	err = p->err;
+	p->err = 0;
+	pthread_mutex_unlock(&p->lock);
+	return err;
+}
+
+/* Wait until every submitted batch is written. Adds the valid samples
+ * written since the last call to *saved, returns the first write error.
+ */
+int pipeline_drain(struct pipeline *p, __u64 *saved){
+	int err;
+
+	pthread_mutex_lock(&p->lock);
+	while (p->next_write != p->next_fill)
+		pthread_cond_wait(&p->cond, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+	err = pipeline_collect(p, saved);
+	if (!err)
+		err = writer_flush(p->writer);
+	return err;
+}
+
+/* Write out what was submitted, join the threads and free the pipeline.
+ * Adds the valid samples written since the last collect or drain to *saved.
+ */
+int pipeline_stop(struct pipeline *p, __u64 *saved){
+	int err, i;
+
+	err = pipeline_drain(p, saved);
+
+	pthread_mutex_lock(&p->lock);
+	p->stopping = true;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	pthread_join(p->writer_thread, NULL);
+	for (i = 0; i < p->nr_workers; i++)
+		pthread_join(p->workers[i], NULL);
+	free_pipeline(p);
+	return err;
+}
@@ -0,0 +1,24 @@
+/* Parallel encoding of drained samples, see collector_pipeline.c */
+#ifndef COLLECTOR_PIPELINE_H
+#define COLLECTOR_PIPELINE_H
+
+#include <linux/types.h>
+
+#include "collector.h"
+#include "collector_format.h"
+
+/* Samples per batch handed from the reader to the workers */
+#define PIPELINE_BATCH		16384
+/* Upper bound of --threads */
+#define PIPELINE_MAX_WORKERS	64
+
+struct pipeline;
+
+struct pipeline *pipeline_start(struct sample_writer *writer, int nr_workers, int queue);
+struct stamp_data *pipeline_next_batch(struct pipeline *p);
+int pipeline_submit(struct pipeline *p, __u32 count);
+int pipeline_collect(struct pipeline *p, __u64 *saved);
+int pipeline_drain(struct pipeline *p, __u64 *saved);
+int pipeline_stop(struct pipeline *p, __u64 *saved);
+
+#endif /* COLLECTOR_PIPELINE_H */
@@ -0,0 +1,184 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Per-session latency percentiles computed while samples are drained, so
+ * p50/p99/p99.9 need no pass over the output file. Every session holds a
+ * fixed-size log-linear histogram per metric, the same HDR-style buckets
+ * the hist mode keeps in the kernel: memory stays bounded no matter how
+ * many samples arrive, at a relative error of 1/HIST_SUB_BUCKETS.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "collector_stats.h"
+
+/* Names of the hist mode metrics, see enum hist_metric */
+const char *const hist_metric_names[HIST_METRICS] = {
+	[HIST_RTT] = "rtt",
+	[HIST_RESIDENCE] = "residence",
+};
+
+static const char *stats_metric_names[STATS_METRICS] = {
+	[STATS_FORWARD] = "forward",
+	[STATS_REVERSE] = "reverse",
+	[STATS_RTT] = "rtt",
+};
+
+/* Sum the per-CPU histograms of one stamp_hist_map entry */
+void hist_merge(struct stamp_hist *merged, const struct stamp_hist *values, int nr_cpus){
+	memset(merged, 0, sizeof(*merged));
+	for (int cpu = 0; cpu < nr_cpus; cpu++) {
+		for (int m = 0; m < HIST_METRICS; m++) {
+			merged->count[m] += values[cpu].count[m];
+			merged->sum_ns[m] += values[cpu].sum_ns[m];
+			merged->negative[m] += values[cpu].negative[m];
+			for (__u32 b = 0; b < HIST_BUCKETS; b++)
+				merged->bucket[m][b] += values[cpu].bucket[m][b];
+		}
+	}
+}
+
+/* Upper bound (in ns) of the bucket holding the given fraction of the count
+ * samples in bucket[HIST_BUCKETS], HIST_OVERFLOW_NS if that is the overflow
+ * bucket
+ */
+__u64 hist_percentile(const __u64 *bucket, __u64 count, double fraction){
+	__u64 rank = fraction * count;
+	__u64 seen = 0;
+
+	for (__u32 b = 0; b < HIST_OVERFLOW_BUCKET; b++) {
+		seen += bucket[b];
+		if (seen > rank)
+			return hist_bucket_low(b) + hist_bucket_width(b) - 1;
+	}
+	return HIST_OVERFLOW_NS;
+}
+
+void stats_init(struct stats_table *t, __s64 offset_ns){
+	memset(t, 0, sizeof(*t));
+	t->offset_ns = offset_ns;
+}
+
+static struct session_stats *lookup_session(struct stats_table *t, __u16 ssid, __u16 vlan){
+	__u32 i = ((__u32)ssid * 2654435761u ^ vlan) % STATS_TABLE_SIZE;
+	struct session_stats *s;
+
+	for (;; i = (i + 1) % STATS_TABLE_SIZE) {
+		s = t->sessions[i];
+		if (!s)
+			break;
+		if (s->key.ssid == ssid && s->key.vlan == vlan)
+			return s;
+	}
+
+	/* Half the table stays empty, so the probe above always ends */
+	if (t->nr_sessions >= STAMP_MAX_SESSIONS)
+		return NULL;
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->key.ssid = ssid;
+	s->key.vlan = vlan;
+	t->sessions[i] = s;
+	t->nr_sessions++;
+	return s;
+}
+
+static void hist_add(struct latency_hist *h, __s64 value_ns){
+	if (value_ns < 0) {
+		h->negative++;
+		return;
+	}
+	h->count++;
+	h->sum_ns += value_ns;
+	if ((__u64)value_ns > h->max_ns)
+		h->max_ns = value_ns;
+	h->bucket[hist_bucket(value_ns)]++;
+}
+
+/* Record the forward, reverse and round-trip delay of one sample */
+void stats_record(struct stats_table *t, const struct stamp_data *d){
+	struct session_stats *s;
+	__u64 test_tx, test_rx, reply_tx, reply_rx;
+	__s64 delay[STATS_METRICS];
+	int m;
+
+	test_tx = stamp_ts64(d->test_tx[0], d->test_tx[1]);
+	test_rx = stamp_ts64(d->test_rx[0], d->test_rx[1]);
+	reply_tx = stamp_ts64(d->reply_tx[0], d->reply_tx[1]);
+	if (!stamp_ntp_valid(test_tx) || !stamp_ntp_valid(test_rx) || !stamp_ntp_valid(reply_tx)) {
+		t->invalid++;
+		return;
+	}
+	s = lookup_session(t, d->ssid, d->vlan);
+	if (!s) {
+		t->untracked++;
+		return;
+	}
+
+	/* All timestamps in ns since the Unix epoch, as in collect_hist() */
+	test_tx = stamp_ntp_to_ns(test_tx);
+	test_rx = stamp_ntp_to_ns(test_rx);
+	reply_tx = stamp_ntp_to_ns(reply_tx);
+	reply_rx = d->rx_clock == RX_CLOCK_KERNEL ? stamp_ktime_to_ns(d->reply_rx, t->offset_ns) : d->reply_rx;
+
+	delay[STATS_FORWARD] = stamp_delta_ns(test_rx, test_tx);
+	delay[STATS_REVERSE] = stamp_delta_ns(reply_rx, reply_tx);
+	delay[STATS_RTT] = stamp_delta_ns(reply_rx, test_tx) - stamp_delta_ns(reply_tx, test_rx);
+	for (m = 0; m < STATS_METRICS; m++) {
+		hist_add(&s->total[m], delay[m]);
+		hist_add(&s->window[m], delay[m]);
+	}
+}
+
+/* hist_percentile() capped at the largest sample, which also bounds the
+ * overflow bucket
+ */
+static __u64 latency_percentile(const struct latency_hist *h, double fraction){
+	__u64 high = hist_percentile(h->bucket, h->count, fraction);
+
+	return high < h->max_ns ? high : h->max_ns;
+}
+
+/* Print p50/p99/p99.9 of every session and metric, either of the samples
+ * since the last window summary (which starts a new window) or of all.
+ */
+void stats_print(struct stats_table *t, bool window){
+	struct latency_hist *h;
+	struct session_stats *s;
+	__u32 i;
+	int m;
+
+	for (i = 0; i < STATS_TABLE_SIZE; i++) {
+		s = t->sessions[i];
+		if (!s)
+			continue;
+		for (m = 0; m < STATS_METRICS; m++) {
+			h = window ? &s->window[m] : &s->total[m];
+			if (!h->count && !h->negative)
+				continue;
+			printf("SSID %u VLAN %u %s: %llu samples, mean %.3f us, p50 %.3f us, p99 %.3f us, p99.9 %.3f us, max %.3f us, %llu negative\n",
+			       s->key.ssid, s->key.vlan, stats_metric_names[m],
+			       (unsigned long long)h->count,
+			       h->count ? (double)h->sum_ns / h->count / 1000 : 0,
+			       latency_percentile(h, 0.5) / 1000.0,
+			       latency_percentile(h, 0.99) / 1000.0,
+			       latency_percentile(h, 0.999) / 1000.0,
+			       h->max_ns / 1000.0, (unsigned long long)h->negative);
+		}
+		if (window)
+			memset(s->window, 0, sizeof(s->window));
+	}
+	if (!window && (t->untracked || t->invalid))
+		printf("%llu samples of sessions beyond %d not tracked, %llu failed validation\n",
+		       (unsigned long long)t->untracked, STAMP_MAX_SESSIONS,
+		       (unsigned long long)t->invalid);
+}
+
+void stats_free(struct stats_table *t){
+	for (__u32 i = 0; i < STATS_TABLE_SIZE; i++) {
+		free(t->sessions[i]);
+		t->sessions[i] = NULL;
+	}
+	t->nr_sessions = 0;
+}
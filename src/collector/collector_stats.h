@@ -0,0 +1,56 @@
+/* Online latency statistics of the collected samples, see collector_stats.c */
+#ifndef COLLECTOR_STATS_H
+#define COLLECTOR_STATS_H
+
+#include <stdbool.h>
+#include <linux/types.h>
+
+#include "collector.h"
+
+/* Percentile in the overflow bucket, above every finite bound */
+#define HIST_OVERFLOW_NS	((__u64)-1)
+
+extern const char *const hist_metric_names[HIST_METRICS];
+
+enum stats_metric {
+	STATS_FORWARD,		/* test_rx - test_tx, sender to reflector */
+	STATS_REVERSE,		/* reply_rx - reply_tx, reflector to sender */
+	STATS_RTT,		/* (reply_rx - test_tx) - (reply_tx - test_rx) */
+	STATS_METRICS
+};
+
+/* Log-linear histogram with the buckets of the hist mode, see hist_bucket() */
+struct latency_hist {
+	__u64 count;
+	__u64 sum_ns;
+	__u64 max_ns;
+	__u64 negative;		/* Not bucketed, clocks out of sync */
+	__u64 bucket[HIST_BUCKETS];
+};
+
+struct session_stats {
+	struct session_key key;
+	struct latency_hist total[STATS_METRICS];
+	struct latency_hist window[STATS_METRICS];	/* Since the last summary */
+};
+
+/* Sessions by (ssid, vlan), at most STAMP_MAX_SESSIONS of them */
+#define STATS_TABLE_SIZE	(2 * STAMP_MAX_SESSIONS)
+
+struct stats_table {
+	__s64 offset_ns;	/* CLOCK_REALTIME - CLOCK_MONOTONIC */
+	struct session_stats *sessions[STATS_TABLE_SIZE];
+	__u32 nr_sessions;
+	__u64 untracked;	/* Samples of sessions beyond STAMP_MAX_SESSIONS */
+	__u64 invalid;		/* Samples failing validation */
+};
+
+void hist_merge(struct stamp_hist *merged, const struct stamp_hist *values, int nr_cpus);
+__u64 hist_percentile(const __u64 *bucket, __u64 count, double fraction);
+
+void stats_init(struct stats_table *t, __s64 offset_ns);
+void stats_record(struct stats_table *t, const struct stamp_data *d);
+void stats_print(struct stats_table *t, bool window);
+void stats_free(struct stats_table *t);
+
+#endif /* COLLECTOR_STATS_H */
@@ -11,6 +11,9 @@ static const char *__doc__ = "XDP loader and stats program\n"
 #include <locale.h>
 #include <unistd.h>
 #include <time.h>
+#include <signal.h>
+#include <math.h>
+#include <sys/mman.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
@@ -21,10 +24,26 @@ static const char *__doc__ = "XDP loader and stats program\n"
 
 #include "../common/common_params.h"
 #include "../common/common_user_bpf_xdp.h"
+#include "../common/common_clock.h"
 #include "collector.h"
+#include "collector_format.h"
+#include "collector_pipeline.h"
+#include "collector_stats.h"
+#include "collector_metrics.h"
 
 static const char *default_filename = "collector_kern.o";
 static const char *default_progname = "stamp_collector";
+static const char *default_tc_progname = "stamp_collector_tc";
+
+#define RINGBUF_POLL_MS 100
+#define WAIT_POLL_MS 100
+/* Kernel internal errno, returned for maps without batch operations */
+#ifndef ENOTSUPP
+#define ENOTSUPP 524
+#endif
+
+/* Daemon mode: 1/DRAIN_GUARD_DIV of a wrapped ring is left to the kernel */
+#define DRAIN_GUARD_DIV 16
 
 const struct bpf_map_info stamp_data_map_expect = { 
 	.key_size = sizeof(__u32), 
@@ -33,9 +52,50 @@ const struct bpf_map_info stamp_data_map_expect = {
 	};
 const struct bpf_map_info counter_map_expect = { 
 	.key_size = sizeof(__u32), 
-	.value_size  = sizeof(__u32),
-	.max_entries = 1
+	.value_size  = sizeof(__u64),
+	.max_entries = COUNTER_MAP_SIZE
+	};
+const struct bpf_map_info percpu_counter_map_expect = {
+	.key_size = sizeof(__u32),
+	.value_size  = sizeof(__u64),
+	.max_entries = PERCPU_COUNTER_MAP_SIZE
+	};
+
+const struct bpf_map_info stamp_hist_map_expect = {
+	.key_size = sizeof(struct session_key),
+	.value_size  = sizeof(struct stamp_hist),
+	.max_entries = STAMP_MAX_SESSIONS
 	};
+const struct bpf_map_info clock_offset_map_expect = {
+	.key_size = sizeof(__u32),
+	.value_size  = sizeof(__s64),
+	.max_entries = CLOCK_OFFSET_MAP_SIZE
+	};
+const struct bpf_map_info seq_state_map_expect = {
+	.key_size = sizeof(struct session_key),
+	.value_size  = sizeof(struct seq_state),
+	.max_entries = STAMP_MAX_SESSIONS
+	};
+const struct bpf_map_info stamp_ringbuf_expect = {
+	.type = BPF_MAP_TYPE_RINGBUF,
+	.max_entries = STAMP_RINGBUF_SIZE
+	};
+
+/* Names of the collector modes, see enum collect_mode */
+static const char *collect_mode_names[] = {
+	[COLLECT_SHARED] = "shared",
+	[COLLECT_PERCPU] = "percpu",
+	[COLLECT_RINGBUF] = "ringbuf",
+	[COLLECT_HIST] = "hist",
+};
+#define NUM_COLLECT_MODES (sizeof(collect_mode_names) / sizeof(collect_mode_names[0]))
+
+static volatile sig_atomic_t exiting;
+
+static void handle_signal(int sig)
+{
+	exiting = 1;
+}
 
 int find_map_fd(struct bpf_object *bpf_obj, const char *mapname)
 {
@@ -99,97 +159,694 @@ static int __check_map_fd_info(int map_fd, struct bpf_map_info *info,
 	return 0;
 }
 
-double ntp2unix(uint32_t seconds_part, uint32_t fractional_part){
-	// Calculate the fractional part in seconds as a double
-    double fractional_seconds = (double)fractional_part / (double)UINT32_MAX;
+/* Find a map of the loaded object, verify its layout and print its info */
+static int open_checked_map(struct bpf_object *bpf_obj, const char *mapname,
+			    const struct bpf_map_info *exp)
+{
+	struct bpf_map_info info = { 0 };
+	int map_fd;
 
-    // Calculate the total time in seconds
-    double total_seconds = (double)seconds_part + fractional_seconds;
+	map_fd = find_map_fd(bpf_obj, mapname);
+	if (map_fd < 0)
+		return -1;
 
-	// Convert to Unix timestamp
-	total_seconds -= NTP_UNIX_OFFSET;
-	
-	return total_seconds;
+	if (__check_map_fd_info(map_fd, &info, exp)) {
+		fprintf(stderr, "ERR: map via FD not compatible\n");
+		return -1;
+	}
+	printf(" - BPF map (bpf_map_type:%d) id:%d name:%s"
+		       " key_size:%d value_size:%d max_entries:%d\n",
+		       info.type, info.id, info.name,
+		       info.key_size, info.value_size, info.max_entries
+		       );
+
+	return map_fd;
 }
 
-double uptime2unix(uint64_t system_up_ns, double offset){
-	double up_s = (double)system_up_ns / NANOSEC_PER_SEC;
-	
-	return up_s + offset;
+/* Zero one key of a per-CPU counter map on every CPU */
+static int reset_percpu_counter(int map_fd, __u32 key)
+{
+	__u64 *values;
+	int err;
+
+	values = calloc(libbpf_num_possible_cpus(), sizeof(__u64));
+	if (!values)
+		return -1;
+
+	err = bpf_map_update_elem(map_fd, &key, values, BPF_EXIST);
+	free(values);
+	return err;
 }
 
-double calc_timestamp_offset(){
-	/* Calculate offset between system uptime and Unix timestamp */ 
-	int res;
-	struct timespec unix_time;
-	res = clock_gettime(CLOCK_REALTIME, &unix_time);
-	if (res < 0) {
-		fprintf(stderr, "Error with gettimeofday! (%i)\n", res);
-		exit(EXIT_FAIL);
+/* Delete every entry of a (pinned) hash map left over from a previous run */
+static void clear_hash_map(int map_fd, size_t key_size)
+{
+	char key[key_size];
+
+	while (bpf_map_get_next_key(map_fd, NULL, key) == 0) {
+		if (bpf_map_delete_elem(map_fd, key) != 0)
+			break;
 	}
-	double current_seconds = (double)unix_time.tv_sec + ((double)unix_time.tv_nsec / NANOSEC_PER_SEC);
-	
-	struct timespec uptime;
-	res = clock_gettime(CLOCK_MONOTONIC, &uptime);
-	if (res < 0) {
-		fprintf(stderr, "Error with gettimeofday! (%i)\n", res);
-		exit(EXIT_FAIL);
+}
+
+/* A map of the opened, not yet loaded, object that libbpf would reuse from
+ * its pin. It is opened here and handed to the object, so it can be reset
+ * before the program is attached. -1 without a compatible pin; the load
+ * then creates the map, zeroed.
+ */
+static int open_pinned_map(struct bpf_object *bpf_obj, const char *mapname,
+			   const struct bpf_map_info *exp)
+{
+	struct bpf_map *map = bpf_object__find_map_by_name(bpf_obj, mapname);
+	const char *pin_path = map ? bpf_map__pin_path(map) : NULL;
+	struct bpf_map_info info = { 0 };
+	int map_fd;
+
+	if (!pin_path)
+		return -1;
+	map_fd = bpf_obj_get(pin_path);
+	if (map_fd < 0)
+		return -1;
+	if (__check_map_fd_info(map_fd, &info, exp) || bpf_map__reuse_fd(map, map_fd)) {
+		close(map_fd);
+		return -1;
 	}
-	double up_seconds = (double)uptime.tv_sec + ((double)uptime.tv_nsec / NANOSEC_PER_SEC);
-	
-	double time_offset = (double)current_seconds - (double)up_seconds;
-	printf("Current Unix timestamp: %f, System up seconds: %f, Offset:%f\n", current_seconds, up_seconds, time_offset);
+	return map_fd;
+}
+
+/* Reset the counters, heads and session state a previous run left in the
+ * pinned maps. Done before the program is attached, so no reply of this
+ * run is overwritten or loses its sequence state to the reset.
+ */
+static void reset_pinned_maps(struct bpf_object *bpf_obj)
+{
+	__u32 key = COUNTER_KEY;
+	__u64 counter = 0;
+	int map_fd;
 
-	return time_offset;
+	map_fd = open_pinned_map(bpf_obj, "counter_map", &counter_map_expect);
+	if (map_fd >= 0) {
+		if (bpf_map_update_elem(map_fd, &key, &counter, BPF_EXIST) != 0)
+			fprintf(stderr, "ERR: resetting counter_map: %s\n", strerror(errno));
+		close(map_fd);
+	}
+	/* Per-CPU heads, ring buffer drops and RX timestamp fallbacks */
+	map_fd = open_pinned_map(bpf_obj, "percpu_counter_map", &percpu_counter_map_expect);
+	if (map_fd >= 0) {
+		for (key = 0; key < PERCPU_COUNTER_MAP_SIZE; key++) {
+			if (reset_percpu_counter(map_fd, key) != 0)
+				fprintf(stderr, "ERR: resetting percpu_counter_map: %s\n", strerror(errno));
+		}
+		close(map_fd);
+	}
+	map_fd = open_pinned_map(bpf_obj, "seq_state_map", &seq_state_map_expect);
+	if (map_fd >= 0) {
+		clear_hash_map(map_fd, sizeof(struct session_key));
+		close(map_fd);
+	}
+	map_fd = open_pinned_map(bpf_obj, "stamp_hist_map", &stamp_hist_map_expect);
+	if (map_fd >= 0) {
+		clear_hash_map(map_fd, sizeof(struct session_key));
+		close(map_fd);
+	}
 }
 
-int save_data(int data_map_fd, __u32 len, FILE *out_file_fd){
-	fprintf(out_file_fd, "ssid,seq,test_tx,test_rx,reply_tx,reply_rx\n");
-	double offset = calc_timestamp_offset();
-	int saved_len = 0;
+/* Sum one key of a per-CPU counter map over all CPUs */
+static __u64 sum_percpu_counter(int map_fd, __u32 key)
+{
+	int nr_cpus = libbpf_num_possible_cpus();
+	__u64 values[nr_cpus];
+	__u64 sum = 0;
 
-	for (__u32 i = 0; i < len; i ++){
-		struct stamp_data value;
-		if ((bpf_map_lookup_elem(data_map_fd, &i, &value)) != 0) {
+	if ((bpf_map_lookup_elem(map_fd, &key, values)) != 0) {
+		perror("Failed looking up per-CPU counter: ");
+		return 0;
+	}
+	for (int cpu = 0; cpu < nr_cpus; cpu++)
+		sum += values[cpu];
+
+	return sum;
+}
+
+static __u64 now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * NANOSEC_PER_SEC + ts.tv_nsec;
+}
+
+static __u64 now_ms(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* The rings samples are written to in the shared and per-CPU modes. Ring r
+ * is ring_size consecutive entries of the data map starting at
+ * r * ring_size, its head counts every sample ever written to it, and
+ * drained[r] the samples already saved.
+ */
+struct ring_source {
+	int data_map_fd;
+	const struct stamp_data *data_mmap;	/* NULL if not mmap-able */
+	bool no_batch;		/* bpf_map_lookup_batch not supported */
+	int head_map_fd;	/* counter_map, or percpu_counter_map if percpu */
+	bool percpu;
+	int nr_rings;
+	__u32 ring_size;
+	__u64 *drained;
+	__u64 read_samples;	/* Drain throughput, see print_drain_stats */
+	__u64 read_ns;
+};
+
+/* The conversion error bounds, and the replies taken before the offsets
+ * were written, which only carry the offset measured at start
+ */
+static void print_clock_stats(const struct clock_tracker *ct, int percpu_counter_fd){
+	int key = ct->tai ? CLOCK_OFFSET_TAI : CLOCK_OFFSET_MONO;
+	__u64 raw = sum_percpu_counter(percpu_counter_fd, CLOCK_FALLBACK_KEY);
+
+	printf("reply_rx from %s, offset refreshed %llu times: largest step %lld ns, read uncertainty %lld ns\n",
+	       ct->tai ? "CLOCK_TAI" : "CLOCK_MONOTONIC", (unsigned long long)ct->refreshes,
+	       (long long)ct->max_step[key], (long long)ct->max_uncertainty);
+	if (raw)
+		printf("%llu replies before the clock offsets were written, converted with the offset at start\n",
+		       (unsigned long long)raw);
+}
+
+/* Where saved samples go: the writer, directly or through a pipeline, and
+ * the live statistics.
+ */
+struct sample_output {
+	struct sample_writer *writer;
+	struct pipeline *pipeline;	/* NULL to write on the collector thread */
+	struct stats_table *stats;
+	struct stamp_data *batch;	/* Pipeline batch being filled */
+	__u32 batch_len;
+	__u64 dropped;			/* Samples dropped, write queue full */
+};
+
+/* Hand the batch being filled to the pipeline */
+static void submit_batch(struct sample_output *out){
+	if (out->batch)
+		pipeline_submit(out->pipeline, out->batch_len);
+	out->batch = NULL;
+	out->batch_len = 0;
+}
+
+/* Add a sample to the pipeline batch, or drop it if the write queue is
+ * full so the collector keeps draining while the disk is slow
+ */
+static void queue_sample(struct sample_output *out, const struct stamp_data *d){
+	if (!out->batch) {
+		out->batch = pipeline_next_batch(out->pipeline);
+		if (!out->batch) {
+			out->dropped++;
+			return;
+		}
+	}
+	out->batch[out->batch_len++] = *d;
+	if (out->batch_len == PIPELINE_BATCH)
+		submit_batch(out);
+}
+
+/* Map stamp_data_map read-only, it is created with BPF_F_MMAPABLE */
+static const struct stamp_data *mmap_data_map(int data_map_fd){
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t size = sizeof(struct stamp_data) * (size_t)STAMP_MAP_SIZE;
+	void *data;
+
+	size = (size + page_size - 1) / page_size * page_size;
+	data = mmap(NULL, size, PROT_READ, MAP_SHARED, data_map_fd, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+	return data;
+}
+
+static void munmap_data_map(const struct stamp_data *data){
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t size = sizeof(struct stamp_data) * (size_t)STAMP_MAP_SIZE;
+
+	size = (size + page_size - 1) / page_size * page_size;
+	munmap((void *)data, size);
+}
+
+static const char *drain_method(const struct ring_source *src){
+	if (src->data_mmap)
+		return "mmap";
+	return src->no_batch ? "lookup" : "batch lookup";
+}
+
+/* Copy n consecutive entries of the data map, starting at index first.
+ * Straight from the shared mapping if possible, otherwise in as few
+ * syscalls as the kernel allows.
+ */
+static int read_data_range(struct ring_source *src, __u32 first, __u32 n, struct stamp_data *dst){
+	__u32 done = 0, count, in_batch, out_batch;
+	__u32 *keys;
+	int err = 0;
+
+	if (src->data_mmap) {
+		memcpy(dst, src->data_mmap + first, n * sizeof(*dst));
+		return 0;
+	}
+
+	if (!src->no_batch) {
+		keys = malloc(n * sizeof(*keys));
+		if (!keys)
+			return -ENOMEM;
+		while (done < n) {
+			/* The batch resumes after in_batch, NULL starts at key 0 */
+			in_batch = first + done - 1;
+			count = n - done;
+			err = bpf_map_lookup_batch(src->data_map_fd, first + done ? &in_batch : NULL,
+						   &out_batch, keys + done, dst + done, &count, NULL);
+			done += count;
+			if (err)
+				break;
+		}
+		free(keys);
+		if (done >= n)
+			return 0;
+		if (done || (err != -EINVAL && err != -EOPNOTSUPP && err != -ENOTSUPP)) {
+			fprintf(stderr, "ERR: batch lookup of stamp_data_map: %s\n", strerror(-err));
+			return err;
+		}
+		/* Kernel without batch support for this map */
+		src->no_batch = true;
+	}
+
+	for (__u32 i = 0; i < n; i++) {
+		__u32 index = first + i;
+		if ((bpf_map_lookup_elem(src->data_map_fd, &index, &dst[i])) != 0) {
 			perror("Error ");
-			return -1;
+			return -errno;
 		}
+	}
+	return 0;
+}
+
+static void print_drain_stats(const struct ring_source *src){
+	double secs = src->read_ns / 1e9;
+
+	printf("Drained %llu samples in %.3f ms (%.0f samples/s, %s)\n",
+	       (unsigned long long)src->read_samples, secs * 1000,
+	       secs > 0 ? src->read_samples / secs : 0, drain_method(src));
+}
+
+static int read_ring_heads(const struct ring_source *src, __u64 *heads){
+	__u32 key = src->percpu ? PERCPU_HEAD_KEY : COUNTER_KEY;
+
+	if ((bpf_map_lookup_elem(src->head_map_fd, &key, heads)) != 0) {
+		perror("Failed looking up ring heads: ");
+		return -1;
+	}
+	return 0;
+}
+
+/* Save the samples written to every ring since the last drain, merged by
+ * reply_rx. Samples within one ring are already in capture order, so a
+ * k-way merge over the ring heads gives a time-ordered output. While the
+ * kernel is still writing, the oldest guard entries of a ring that wrapped
+ * are skipped as they may be overwritten during the read.
+ *
+ * With a pipeline, the merged samples are handed to its workers in batches
+ * instead of being written here, and the writer is left to the pipeline.
+ * The samples it wrote since the last drain are counted as saved, without
+ * waiting for the rest.
+ */
+static int drain_rings(struct ring_source *src, __u32 guard, struct sample_output *out){
+	struct pipeline *pipeline = out->pipeline;
+	int nr_rings = src->nr_rings;
+	__u64 heads[nr_rings];
+	struct stamp_data *segs[nr_rings];
+	__u32 lens[nr_rings], pos[nr_rings];
+	__u64 saved = 0;
+	int saved_len = 0;
+	int ring;
+
+	if (read_ring_heads(src, heads) != 0)
+		return -1;
 
-		// Process data
-		uint16_t ssid = value.ssid;
-		uint32_t seq = value.seq;
-		double test_tx = ntp2unix(value.test_tx[0], value.test_tx[1]);
-		double test_rx = ntp2unix(value.test_rx[0], value.test_rx[1]);
-		double reply_tx = ntp2unix(value.reply_tx[0], value.reply_tx[1]);
-		double reply_rx = uptime2unix(value.reply_rx, offset);
+	for (ring = 0; ring < nr_rings; ring++) {
+		__u64 head = heads[ring];
+		__u64 start = src->drained[ring];
+		__u32 avail = src->ring_size - guard;
 
-		// Validate data
-		if (test_tx < 0){
+		segs[ring] = NULL;
+		pos[ring] = 0;
+		lens[ring] = 0;
+		if (head <= start)
 			continue;
+
+		if (head - start > avail) {
+			printf(" - Ring %d wrapped, %llu samples overwritten\n",
+			       ring, (unsigned long long)(head - avail - start));
+			start = head - avail;
 		}
-		if (test_rx < 0){
-			continue;
+		lens[ring] = head - start;
+
+		segs[ring] = malloc(lens[ring] * sizeof(struct stamp_data));
+		if (!segs[ring]) {
+			fprintf(stderr, "ERR: failed to allocate segment buffer\n");
+			saved_len = -1;
+			goto out;
 		}
-		if (reply_tx < 0){
-			continue;
+
+		/* The range may wrap around the end of the ring */
+		__u32 first = start % src->ring_size;
+		__u32 n = lens[ring] < src->ring_size - first ? lens[ring] : src->ring_size - first;
+		__u64 begin = now_ns();
+
+		if (read_data_range(src, ring * src->ring_size + first, n, segs[ring]) != 0 ||
+		    (n < lens[ring] &&
+		     read_data_range(src, ring * src->ring_size, lens[ring] - n, segs[ring] + n) != 0)) {
+			saved_len = -1;
+			goto out;
+		}
+		src->read_ns += now_ns() - begin;
+		src->read_samples += lens[ring];
+		src->drained[ring] = head;
+	}
+
+	while (1) {
+		int next = -1;
+
+		for (ring = 0; ring < nr_rings; ring++) {
+			if (pos[ring] >= lens[ring])
+				continue;
+			if (next < 0 || segs[ring][pos[ring]].reply_rx < segs[next][pos[next]].reply_rx)
+				next = ring;
+		}
+		if (next < 0)
+			break;
+
+		stats_record(out->stats, &segs[next][pos[next]]);
+		if (pipeline) {
+			queue_sample(out, &segs[next][pos[next]]);
+		} else if (write_sample(out->writer, &segs[next][pos[next]])) {
+			saved_len ++;
 		}
-		if (reply_rx < 0){
+		pos[next]++;
+	}
+
+	if (pipeline) {
+		submit_batch(out);
+		if (pipeline_collect(pipeline, &saved) != 0) {
+			fprintf(stderr, "ERR: failed writing samples\n");
+			saved_len = -1;
+		} else {
+			saved_len = saved;
+		}
+	}
+
+out:
+	for (ring = 0; ring < nr_rings; ring++)
+		free(segs[ring]);
+	return saved_len;
+}
+
+/* A percentile of the kernel histogram in us, inf in the overflow bucket */
+static double hist_percentile_us(const struct stamp_hist *hist, int metric, double fraction){
+	__u64 high = hist_percentile(hist->bucket[metric], hist->count[metric], fraction);
+
+	return high == HIST_OVERFLOW_NS ? INFINITY : high / 1000.0;
+}
+
+/* Merge the per-CPU histograms of every session, print a summary and write
+ * the non-empty buckets. Returns the number of sessions saved.
+ */
+int save_hist(int hist_map_fd, FILE *out_file_fd){
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct stamp_hist *values, merged;
+	struct session_key key, next_key, *prev_key = NULL;
+	int saved_len = 0;
+
+	values = calloc(nr_cpus, sizeof(*values));
+	if (!values) {
+		fprintf(stderr, "ERR: failed to allocate histogram buffer\n");
+		return -1;
+	}
+
+	fprintf(out_file_fd, "ssid,vlan,metric,bucket_low_ns,bucket_high_ns,count\n");
+
+	while (bpf_map_get_next_key(hist_map_fd, prev_key, &next_key) == 0) {
+		key = next_key;
+		prev_key = &key;
+		if ((bpf_map_lookup_elem(hist_map_fd, &key, values)) != 0) {
+			perror("Error ");
 			continue;
 		}
 
+		hist_merge(&merged, values, nr_cpus);
+
+		for (int m = 0; m < HIST_METRICS; m++) {
+			if (!merged.count[m] && !merged.negative[m])
+				continue;
+
+			printf("SSID %u VLAN %u %s: %llu samples, mean %.3f us, p50 %.3f us, p99 %.3f us, p99.9 %.3f us, %llu negative\n",
+			       key.ssid, key.vlan, hist_metric_names[m],
+			       (unsigned long long)merged.count[m],
+			       merged.count[m] ? (double)merged.sum_ns[m] / merged.count[m] / 1000 : 0,
+			       hist_percentile_us(&merged, m, 0.5),
+			       hist_percentile_us(&merged, m, 0.99),
+			       hist_percentile_us(&merged, m, 0.999),
+			       (unsigned long long)merged.negative[m]);
+
+			for (__u32 b = 0; b < HIST_OVERFLOW_BUCKET; b++) {
+				if (!merged.bucket[m][b])
+					continue;
+				fprintf(out_file_fd, "%u,%u,%s,%llu,%llu,%llu\n",
+					key.ssid, key.vlan, hist_metric_names[m],
+					(unsigned long long)hist_bucket_low(b),
+					(unsigned long long)(hist_bucket_low(b) + hist_bucket_width(b)),
+					(unsigned long long)merged.bucket[m][b]);
+			}
+			if (merged.bucket[m][HIST_OVERFLOW_BUCKET])
+				fprintf(out_file_fd, "%u,%u,%s,%llu,inf,%llu\n",
+					key.ssid, key.vlan, hist_metric_names[m],
+					(unsigned long long)hist_bucket_low(HIST_OVERFLOW_BUCKET),
+					(unsigned long long)merged.bucket[m][HIST_OVERFLOW_BUCKET]);
+		}
 		saved_len ++;
-		fprintf(out_file_fd, "%u,%u,%f,%f,%f,%f\n", 
-			ssid, 
-			seq, 
-			test_tx,
-			test_rx,
-			reply_tx,
-			reply_rx);	
 	}
-	
+
+	free(values);
 	return saved_len;
 }
 
+/* Print the loss, duplicate and reorder counters of every session */
+void print_seq_stats(int seq_map_fd){
+	struct session_key key, next_key, *prev_key = NULL;
+	struct seq_state state;
+
+	while (bpf_map_get_next_key(seq_map_fd, prev_key, &next_key) == 0) {
+		key = next_key;
+		prev_key = &key;
+		if ((bpf_map_lookup_elem_flags(seq_map_fd, &key, &state, BPF_F_LOCK)) != 0)
+			continue;
+
+		struct seq_counters *c = &state.counters;
+		/* Late replies were counted as lost when they left the window */
+		__u64 lost = c->lost > c->late ? c->lost - c->late : 0;
+		__u64 expected = c->received - c->duplicate + lost;
+
+		printf("SSID %u VLAN %u: received %llu, lost %llu (%.3f%%), duplicate %llu, reordered %llu, late %llu\n",
+		       key.ssid, key.vlan, (unsigned long long)c->received, (unsigned long long)lost,
+		       expected ? 100.0 * lost / expected : 0,
+		       (unsigned long long)c->duplicate, (unsigned long long)c->reordered,
+		       (unsigned long long)c->late);
+	}
+}
+
+/* Live per-session counters, printed every interval ms while collecting */
+struct live_report {
+	struct clock_tracker *clock;	/* Refreshed on every tick */
+	int seq_map_fd;
+	struct stats_table *stats;	/* Latencies since the last report, or NULL */
+	int interval;
+	__u64 next;
+};
+
+static void live_report_tick(struct live_report *report){
+	clock_tracker_tick(report->clock);
+	if (report->interval <= 0 || now_ms() < report->next)
+		return;
+
+	printf("\n");
+	print_seq_stats(report->seq_map_fd);
+	if (report->stats)
+		stats_print(report->stats, true);
+	report->next = now_ms() + report->interval;
+}
+
+/* Wait until duration seconds have passed (forever if 0) or the collector is
+ * interrupted.
+ */
+static void wait_experiment(int duration, struct live_report *report){
+	__u64 end = now_ms() + (__u64)duration * 1000;
+
+	while (!exiting && (duration <= 0 || now_ms() < end)) {
+		live_report_tick(report);
+		usleep(WAIT_POLL_MS * 1000);
+	}
+}
+
+/* Daemon mode: like wait_experiment(), but save the new samples every
+ * drain_ms so the output lags the packets by less than a second and the
+ * rings never wrap as long as the drain keeps up.
+ */
+static int drain_experiment(struct ring_source *src, int duration, int drain_ms,
+			    struct live_report *report, struct sample_output *out){
+	__u64 end = now_ms() + (__u64)duration * 1000;
+	__u64 next_drain = now_ms() + drain_ms;
+	int saved_len = 0, len;
+
+	while (!exiting && (duration <= 0 || now_ms() < end)) {
+		live_report_tick(report);
+		if (now_ms() >= next_drain) {
+			len = drain_rings(src, src->ring_size / DRAIN_GUARD_DIV, out);
+			if (len < 0)
+				return len;
+			saved_len += len;
+			if (!out->pipeline) {
+				writer_flush(out->writer);
+				fflush(out->writer->fp);
+			}
+			next_drain = now_ms() + drain_ms;
+		}
+		usleep(WAIT_POLL_MS * 1000);
+	}
+	return saved_len;
+}
+
+struct ringbuf_ctx {
+	struct sample_output *out;
+	int saved_len;
+};
+
+static int handle_ringbuf_sample(void *ctx, void *data, size_t size)
+{
+	struct ringbuf_ctx *rb_ctx = ctx;
+
+	if (size < sizeof(struct stamp_data))
+		return 0;
+
+	stats_record(rb_ctx->out->stats, data);
+	if (rb_ctx->out->pipeline)
+		queue_sample(rb_ctx->out, data);
+	else if (write_sample(rb_ctx->out->writer, data))
+		rb_ctx->saved_len ++;
+	return 0;
+}
+
+/* Consume the ring buffer and write samples as they arrive, until duration
+ * seconds have passed (forever if 0) or the collector is interrupted.
+ */
+int stream_data_ringbuf(int ringbuf_fd, int duration, struct live_report *report, struct sample_output *out){
+	struct ringbuf_ctx rb_ctx = { .out = out };
+	struct ring_buffer *rb;
+	__u64 end = now_ms() + (__u64)duration * 1000;
+	int err;
+
+	rb = ring_buffer__new(ringbuf_fd, handle_ringbuf_sample, &rb_ctx, NULL);
+	if (!rb) {
+		fprintf(stderr, "ERR: failed to create ring buffer: %s\n", strerror(errno));
+		return -1;
+	}
+
+	while (!exiting && (duration <= 0 || now_ms() < end)) {
+		live_report_tick(report);
+		err = ring_buffer__poll(rb, RINGBUF_POLL_MS);
+		if (err == -EINTR)
+			continue;
+		if (err < 0) {
+			fprintf(stderr, "ERR: polling ring buffer: %s\n", strerror(-err));
+			break;
+		}
+		if (err > 0 && out->pipeline) {
+			__u64 saved = 0;
+
+			/* Samples wait for the writer thread no longer than a poll */
+			submit_batch(out);
+			if (pipeline_collect(out->pipeline, &saved) != 0)
+				fprintf(stderr, "ERR: failed writing samples\n");
+			rb_ctx.saved_len += saved;
+		} else if (err > 0) {
+			writer_flush(out->writer);
+			fflush(out->writer->fp);
+		}
+	}
+
+	/* Pick up whatever was committed after the last poll */
+	ring_buffer__consume(rb);
+	ring_buffer__free(rb);
+	if (out->pipeline)
+		submit_batch(out);
+
+	return rb_ctx.saved_len;
+}
+
+/* Map --mode to a collector mode, shared ring by default */
+static int resolve_mode(const struct config *cfg, __u8 *mode){
+	unsigned int i;
+
+	*mode = COLLECT_SHARED;
+	if (!cfg->mode[0])
+		return 0;
+
+	for (i = 0; i < NUM_COLLECT_MODES; i++) {
+		if (strcmp(cfg->mode, collect_mode_names[i]) == 0) {
+			*mode = i;
+			return 0;
+		}
+	}
+	fprintf(stderr, "ERR: unknown --mode %s\n", cfg->mode);
+	return EXIT_FAIL_OPTION;
+}
+
+/* Map --format to an output format, CSV by default */
+static int resolve_format(const struct config *cfg, __u8 mode, enum output_format *format){
+	*format = FORMAT_CSV;
+	if (!cfg->format[0] || strcmp(cfg->format, "csv") == 0)
+		return 0;
+
+	if (strcmp(cfg->format, "binary") == 0 && mode != COLLECT_HIST) {
+		*format = FORMAT_BINARY;
+		return 0;
+	}
+	if (strcmp(cfg->format, "zdelta") == 0 && mode != COLLECT_HIST) {
+		*format = FORMAT_ZDELTA;
+		return 0;
+	}
+	fprintf(stderr, "ERR: unsupported --format %s%s\n", cfg->format,
+		mode == COLLECT_HIST ? " in hist mode" : "");
+	return EXIT_FAIL_OPTION;
+}
+
+/* Specialize stamp_collector for this run before it is loaded */
+static int set_collector_rodata(struct bpf_object *obj, const struct config *cfg, __u8 mode,
+				__u32 seg_size, bool tai){
+	__u8 seq_tracking = !cfg->no_seq_tracking;
+	__u8 hw_rx_timestamp = cfg->hw_rx_timestamp;
+	__u8 tai_clock = tai;
+	int err;
+
+	err = set_rodata_var(obj, "collect_mode", &mode, sizeof(mode));
+	if (!err)
+		err = set_rodata_var(obj, "seg_size", &seg_size, sizeof(seg_size));
+	if (!err)
+		err = set_rodata_var(obj, "seq_tracking", &seq_tracking, sizeof(seq_tracking));
+	if (!err)
+		err = set_rodata_var(obj, "hw_rx_timestamp", &hw_rx_timestamp, sizeof(hw_rx_timestamp));
+	if (!err)
+		err = set_rodata_var(obj, "tai_clock", &tai_clock, sizeof(tai_clock));
+	if (!err)
+		err = set_stamp_filter_rodata(obj, cfg);
+	return err;
+}
+
 static const struct option_wrapper long_options[] = {
 	{{"help",        no_argument,		NULL, 'h' },
 	 "Show help", false},
@@ -225,17 +882,66 @@ static const struct option_wrapper long_options[] = {
 	 "Path to the output csv file <out-file>", "<out-file>", true},
 	
 	{{"duration",	 required_argument,	NULL, 't' },
-	 "Duration of running collector in <seconds>", "<seconds>", true},
+	 "Duration of running collector in <seconds>, 0 until interrupted", "<seconds>", true},
+
+	{{"interval",	 required_argument,	NULL,  6  },
+	 "Print per-session loss counters every <ms> while collecting", "<ms>"},
+
+	{{"mode",	 required_argument,	NULL,  5  },
+	 "Collector <mode>: shared (default), percpu, ringbuf or hist", "<mode>"},
+
+	{{"port",	 required_argument,	NULL,  7  },
+	 "Reflector UDP <port> or <port>-<port> range, default 862", "<port>"},
+
+	{{"ssid",	 required_argument,	NULL,  8  },
+	 "Only collect SSID <ssid> or <ssid>-<ssid> range", "<ssid>"},
+
+	{{"local-addr",	 required_argument,	NULL,  9  },
+	 "Only collect replies sent to IPv4/IPv6 <addr>", "<addr>"},
+
+	{{"no-seq",	 no_argument,		NULL,  10 },
+	 "Disable loss, duplicate and reorder tracking"},
+
+	{{"hw-timestamp", no_argument,		NULL,  11 },
+	 "Use driver RX timestamps for reply_rx when available, the NIC clock must be kept at UTC"},
+
+	{{"tc",		 no_argument,		NULL,  12 },
+	 "Attach to tc (clsact) ingress instead of XDP"},
+
+	{{"drain",	 required_argument,	NULL,  13 },
+	 "Daemon mode: append new samples to <out-file> every <ms>", "<ms>"},
+
+	{{"format",	 required_argument,	NULL,  14 },
+	 "Output <format>: csv (default), binary or zdelta", "<format>"},
+
+	{{"threads",	 required_argument,	NULL,  15 },
+	 "Encode drained samples on <n> worker threads", "<n>"},
+
+	{{"metrics",	 required_argument,	NULL,  16 },
+	 "Serve OpenMetrics on [<addr>:]<port>, loopback by default", "<addr>"},
+
+	{{"rotate-size", required_argument,	NULL,  17 },
+	 "Start a new <out-file>.<n> segment every <MiB>, implies a write queue", "<MiB>"},
+
+	{{"rotate-interval", required_argument,	NULL,  18 },
+	 "Start a new <out-file>.<n> segment every <seconds> of wall clock, implies a write queue", "<seconds>"},
+
+	{{"write-queue", required_argument,	NULL,  19 },
+	 "Queue up to <n> batches for the writer thread, drop when full", "<n>"},
 
 	{{0, 0, NULL,  0 }}
 };
 
 int main(int argc, char **argv)
 {
-	struct bpf_map_info info = { 0 };
-	struct xdp_program *program;
-	int stats_map_fd, counter_fd;
-	// int interval = 2;
+	struct xdp_program *program = NULL;
+	struct bpf_object *obj;
+	__u8 mode;
+	enum output_format format;
+	int stats_map_fd, counter_fd, percpu_counter_fd, ringbuf_fd, hist_fd, seq_map_fd;
+	struct live_report report;
+	__u32 seg_size = 0;
+	int num_data = 0;
 	char errmsg[1024];
 	int err;
 
@@ -249,6 +955,36 @@ int main(int argc, char **argv)
 	strncpy(cfg.progname,  default_progname,  sizeof(cfg.progname));
 	/* Cmdline options can change progname */
 	parse_cmdline_args(argc, argv, long_options, &cfg, __doc__);
+	err = resolve_mode(&cfg, &mode);
+	if (!err)
+		err = resolve_format(&cfg, mode, &format);
+	if (err)
+		return err;
+	if (cfg.tc_attach && strcmp(cfg.progname, default_progname) == 0)
+		strncpy(cfg.progname, default_tc_progname, sizeof(cfg.progname));
+	if (cfg.tc_attach && cfg.hw_rx_timestamp)
+		fprintf(stderr, "WARN: --hw-timestamp needs XDP, using the kernel clock\n");
+	if (cfg.threads > PIPELINE_MAX_WORKERS) {
+		fprintf(stderr, "ERR: --threads %d exceeds %d\n", cfg.threads, PIPELINE_MAX_WORKERS);
+		return EXIT_FAIL_OPTION;
+	}
+	if (cfg.threads && mode == COLLECT_HIST)
+		fprintf(stderr, "WARN: --threads does not apply to the hist mode\n");
+	if ((cfg.rotate_size || cfg.rotate_interval) && mode == COLLECT_HIST) {
+		fprintf(stderr, "ERR: --rotate-size and --rotate-interval do not apply to the hist mode\n");
+		return EXIT_FAIL_OPTION;
+	}
+	/* The write queue sits in front of the writer thread, and segments are
+	 * closed and synced there, off the collection path
+	 */
+	if ((cfg.write_queue || cfg.rotate_size || cfg.rotate_interval) && !cfg.threads)
+		cfg.threads = 1;
+	/* A slow fsync at a segment close must not stall draining while the
+	 * maps wrap, so rotation drops and counts through the smallest queue
+	 * unless --write-queue sizes it
+	 */
+	if ((cfg.rotate_size || cfg.rotate_interval) && !cfg.write_queue && mode != COLLECT_HIST)
+		cfg.write_queue = 2 * cfg.threads + 2;
 
 	/* Required option */
 	if (cfg.ifindex == -1) {
@@ -260,6 +996,14 @@ int main(int argc, char **argv)
         /* Unload a program by prog_id, or
          * unload all programs on net device
          */
+	if (cfg.tc_attach && (cfg.do_unload || cfg.unload_all)) {
+		err = do_tc_unload(&cfg);
+		if (err)
+			return err;
+
+		printf("Success: Unloading tc prog name: %s\n", cfg.progname);
+		return EXIT_OK;
+	}
 	if (cfg.do_unload || cfg.unload_all) {
 		err = do_unload(&cfg);
 		if (err) {
@@ -273,127 +1017,275 @@ int main(int argc, char **argv)
 		return EXIT_OK;
 	}
 
-	program = load_bpf_and_xdp_attach(&cfg);
-	if (!program)
+	if (cfg.tc_attach) {
+		obj = open_bpf_object_file(&cfg);
+	} else {
+		program = create_xdp_program(&cfg);
+		obj = xdp_program__bpf_obj(program);
+	}
+	/* Per-CPU ring mode: split the data map into one segment per CPU */
+	if (mode == COLLECT_PERCPU)
+		seg_size = STAMP_MAP_SIZE / libbpf_num_possible_cpus();
+	/* Prefer CLOCK_TAI, which moves with CLOCK_REALTIME, if BPF can read it */
+	struct clock_tracker clock = { .map_fd = -1 };
+	clock.tai = clock_tai_usable(cfg.tc_attach ? BPF_PROG_TYPE_SCHED_CLS : BPF_PROG_TYPE_XDP);
+	err = set_collector_rodata(obj, &cfg, mode, seg_size, clock.tai);
+	if (!err && cfg.hw_rx_timestamp && program)
+		err = set_xdp_dev_bound(program, cfg.ifindex);
+	/* The clock offsets are in place before the first reply arrives */
+	if (!err)
+		err = clock_tracker_use(&clock, obj);
+	if (err) {
+		fprintf(stderr, "ERR: configuring %s: %s\n", cfg.filename, strerror(-err));
 		return EXIT_FAIL_BPF;
+	}
+	reset_pinned_maps(obj);
+	if (cfg.tc_attach)
+		attach_tc_program(obj, &cfg);
+	else
+		attach_xdp_program(program, &cfg);
 
 	if (verbose) {
 		printf("Success: Loaded BPF-object(%s) and used section(%s)\n",
 		       cfg.filename, cfg.progname);
-		printf(" - XDP prog id:%d attached on device:%s(ifindex:%d)\n",
-		       xdp_program__id(program), cfg.ifname, cfg.ifindex);
+		if (program)
+			printf(" - XDP prog id:%d attached on device:%s(ifindex:%d)\n",
+			       attached_xdp_prog_id(program), cfg.ifname, cfg.ifindex);
+		else
+			printf(" - tc prog attached on device:%s(ifindex:%d) ingress\n",
+			       cfg.ifname, cfg.ifindex);
 	}
 
 	/* Prepare BPF map */
 	printf("\nCollecting stats from BPF map\n");
 	
 	/* STAMP data map*/
-	stats_map_fd = find_map_fd(xdp_program__bpf_obj(program), "stamp_data_map");
-	if (stats_map_fd < 0) {
-		/* xdp_link_detach(cfg.ifindex, cfg.xdp_flags, 0); */
+	stats_map_fd = open_checked_map(obj, "stamp_data_map", &stamp_data_map_expect);
+	if (stats_map_fd < 0)
 		return EXIT_FAIL_BPF;
-	}
-	/* check map info for STAMP data*/
-	err = __check_map_fd_info(stats_map_fd, &info, &stamp_data_map_expect);
-	if (err) {
-		fprintf(stderr, "ERR: map via FD not compatible\n");
-		return err;
-	}
-	printf(" - BPF map (bpf_map_type:%d) id:%d name:%s"
-		       " key_size:%d value_size:%d max_entries:%d\n",
-		       info.type, info.id, info.name,
-		       info.key_size, info.value_size, info.max_entries
-		       );
 
 	/* counter map */
-	counter_fd = find_map_fd(xdp_program__bpf_obj(program), "counter_map");
-	if (counter_fd < 0) {
-		/* xdp_link_detach(cfg.ifindex, cfg.xdp_flags, 0); */
+	counter_fd = open_checked_map(obj, "counter_map", &counter_map_expect);
+	if (counter_fd < 0)
 		return EXIT_FAIL_BPF;
+
+	/* per-CPU counter map */
+	percpu_counter_fd = open_checked_map(obj, "percpu_counter_map", &percpu_counter_map_expect);
+	if (percpu_counter_fd < 0)
+		return EXIT_FAIL_BPF;
+
+	/* Sequence tracking state of every session */
+	seq_map_fd = open_checked_map(obj, "seq_state_map", &seq_state_map_expect);
+	if (seq_map_fd < 0)
+		return EXIT_FAIL_BPF;
+	report.clock = &clock;
+	report.seq_map_fd = seq_map_fd;
+	report.stats = NULL;
+	report.interval = cfg.interval;
+	report.next = now_ms() + cfg.interval;
+
+	/* Clock offsets used to convert reply_rx in the kernel, filled before
+	 * attaching
+	 */
+	if (open_checked_map(obj, "clock_offset_map", &clock_offset_map_expect) < 0)
+		return EXIT_FAIL_BPF;
+	/* Raw CLOCK_MONOTONIC samples are converted with the offset at start */
+	__s64 clock_offset = clock.offset[CLOCK_OFFSET_MONO];
+
+	if (mode == COLLECT_PERCPU)
+		printf(" - %d CPUs, %u data points per CPU segment\n", libbpf_num_possible_cpus(), seg_size);
+
+	/* Samples stream out of the ring buffer, the hist mode saves the
+	 * kernel's histograms at the end
+	 */
+	if (mode == COLLECT_RINGBUF) {
+		ringbuf_fd = open_checked_map(obj, "stamp_ringbuf", &stamp_ringbuf_expect);
+		if (ringbuf_fd < 0)
+			return EXIT_FAIL_BPF;
 	}
-	/* check map info for STAMP data*/
-	err = __check_map_fd_info(counter_fd, &info, &counter_map_expect);
-	if (err) {
-		fprintf(stderr, "ERR: map via FD not compatible\n");
-		return err;
+	if (mode == COLLECT_HIST) {
+		hist_fd = open_checked_map(obj, "stamp_hist_map", &stamp_hist_map_expect);
+		if (hist_fd < 0)
+			return EXIT_FAIL_BPF;
 	}
-	printf(" - BPF map (bpf_map_type:%d) id:%d name:%s"
-		       " key_size:%d value_size:%d max_entries:%d\n",
-		       info.type, info.id, info.name,
-		       info.key_size, info.value_size, info.max_entries
-		       );
-	// Setting counter to 0
-	__u32 counter = 0;
-	__u32 counter_key = COUNTER_KEY;
-	if (bpf_map_update_elem(counter_fd, &counter_key, &counter, BPF_EXIST) != 0){
-		fprintf(stderr, "ERR: %s\n", strerror(errno));
+
+	/* Prepare output file */
+	/* Daemon mode appends, so a restarted collector continues the file */
+	bool drain = cfg.drain_interval > 0 && (mode == COLLECT_SHARED || mode == COLLECT_PERCPU);
+	bool append = drain;
+	/* The rolling summaries only see saved samples, so --interval drains
+	 * the rings at least that often
+	 */
+	if (cfg.interval > 0 && (mode == COLLECT_SHARED || mode == COLLECT_PERCPU) &&
+	    (!drain || cfg.drain_interval > cfg.interval)) {
+		cfg.drain_interval = cfg.interval;
+		drain = true;
+	}
+	bool rotate = cfg.rotate_size || cfg.rotate_interval;
+	struct sample_writer writer;
+	FILE *out_fp = NULL;
+	if (rotate) {
+		/* Segments are numbered on from the ones already there */
+		err = writer_init_segments(&writer, cfg.out_file, format, clock_offset,
+					   (__u64)cfg.rotate_size << 20,
+					   (__u64)cfg.rotate_interval * NANOSEC_PER_SEC);
+		if (err) {
+			fprintf(stderr, "ERR: failed to start writing '%s' segments: %s\n",
+				cfg.out_file, strerror(-err));
+			exit(EXIT_FAIL);
+		}
+		printf(" - Writing segments from %s.%06u\n", cfg.out_file, writer.segment);
+	} else {
+		out_fp = fopen(cfg.out_file, append ? "a" : "w");
+		if( out_fp == NULL ) {
+			perror("Failed open output file: ");
+			exit(EXIT_FAIL);
+		}
+		if (mode != COLLECT_HIST && writer_init(&writer, out_fp, format, clock_offset) != 0) {
+			fprintf(stderr, "ERR: failed to start writing '%s'\n", cfg.out_file);
+			exit(EXIT_FAIL);
+		}
 	}
 
+	struct stats_table stats;
+	struct sample_output output = { .writer = &writer, .stats = &stats };
+
+	/* Scrapes read the maps directly, whatever the mode */
+	struct metrics_server *metrics = NULL;
+	if (cfg.metrics_addr[0]) {
+		struct metrics_source msrc = {
+			.mode = mode,
+			.seq_map_fd = cfg.no_seq_tracking ? -1 : seq_map_fd,
+			.counter_fd = counter_fd,
+			.percpu_counter_fd = percpu_counter_fd,
+			.hist_map_fd = -1,
+		};
+
+		if (mode == COLLECT_HIST)
+			msrc.hist_map_fd = hist_fd;
+		metrics = metrics_start(cfg.metrics_addr, &msrc);
+		if (!metrics)
+			exit(EXIT_FAIL);
+		printf(" - Serving OpenMetrics on http://%s/metrics\n", cfg.metrics_addr);
+	}
+
+	if (cfg.threads > 0 && mode != COLLECT_HIST) {
+		output.pipeline = pipeline_start(&writer, cfg.threads, cfg.write_queue);
+		if (!output.pipeline) {
+			fprintf(stderr, "ERR: failed to start %d worker threads\n", cfg.threads);
+			exit(EXIT_FAIL);
+		}
+		printf(" - Encoding samples on %d worker threads\n", cfg.threads);
+		if (cfg.write_queue)
+			printf(" - Writing through a queue of %d batches\n", cfg.write_queue);
+	}
+
+	/* Latency percentiles of the samples as they are saved, the hist mode
+	 * keeps its own in the kernel
+	 */
+	stats_init(&stats, clock_offset);
+	if (mode != COLLECT_HIST)
+		report.stats = &stats;
+
+	/* Stop early (and still save what was collected) on Ctrl-C */
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
 	/* Trick to pretty printf with thousands separators use %' */
 	setlocale(LC_NUMERIC, "en_US");
 	printf("\nStarting STAMP Collector\n");
 
-	
+	if (mode == COLLECT_RINGBUF) {
+		/* Samples are written out while the experiment runs */
+		num_data = stream_data_ringbuf(ringbuf_fd, cfg.duration, &report, &output);
 
-	/* Finished setting up eBPF program */
-	sleep(cfg.duration);
+		printf("Experiment finished\n");
+		print_seq_stats(seq_map_fd);
+		print_clock_stats(&clock, percpu_counter_fd);
+		stats_print(&stats, false);
+		if (cfg.hw_rx_timestamp)
+			printf("%llu replies fell back to the kernel clock, no HW RX timestamp\n",
+			       (unsigned long long)sum_percpu_counter(percpu_counter_fd, RX_TS_FALLBACK_KEY));
+		printf("%llu data points dropped, ring buffer full\n",
+		       (unsigned long long)sum_percpu_counter(percpu_counter_fd, RINGBUF_DROP_KEY));
+	} else if (mode == COLLECT_HIST) {
+		wait_experiment(cfg.duration, &report);
 
-	printf("Experiment finished\n");
+		printf("Experiment finished\n");
+		print_seq_stats(seq_map_fd);
+		print_clock_stats(&clock, percpu_counter_fd);
+		if (cfg.hw_rx_timestamp)
+			printf("%llu replies fell back to the kernel clock, no HW RX timestamp\n",
+			       (unsigned long long)sum_percpu_counter(percpu_counter_fd, RX_TS_FALLBACK_KEY));
 
-	/* Prepare output file */	
-	// char saving_dir[] = "./data/";
-	// int saving_dir_len = 7;
-	// char exp_name[] = "test";
-	// int exp_name_len = 4;
-	
-	// int out_path_len = saving_dir_len + exp_name_len + 8;
-	// char out_path[out_path_len + 1];
-	// err = snprintf(out_path, out_path_len + 1, "%s%s%s", saving_dir, exp_name, "_raw.csv");
-	// if (err < 0){
-	// 	exit(EXIT_FAIL); // file write to buffer
-	// }
-
-	FILE *out_fp;
-	out_fp = fopen(cfg.out_file, "w");
-	if( out_fp == NULL ) {
-		perror("Failed open output file: ");
-    	exit(EXIT_FAIL);
-   }
-	
-	/* Collect and save data */
-	__u32 data_len;
-	if ((bpf_map_lookup_elem(counter_fd, &counter_key, &data_len)) != 0) {
-		perror("Failed looking up counter map: ");
+		int num_hist = save_hist(hist_fd, out_fp);
+		printf("%d session histograms saved to '%s'\n", num_hist, cfg.out_file);
+	} else {
+		struct ring_source src = {
+			.data_map_fd = stats_map_fd,
+			.head_map_fd = mode == COLLECT_PERCPU ? percpu_counter_fd : counter_fd,
+			.percpu = mode == COLLECT_PERCPU,
+			.nr_rings = mode == COLLECT_PERCPU ? libbpf_num_possible_cpus() : 1,
+			.ring_size = mode == COLLECT_PERCPU ? seg_size : STAMP_MAP_SIZE,
+		};
+		__u64 drained[src.nr_rings];
+		int len;
+
+		memset(drained, 0, sizeof(drained));
+		src.drained = drained;
+		src.data_mmap = mmap_data_map(stats_map_fd);
+		if (!src.data_mmap)
+			printf(" - stamp_data_map is not mmap-able, using %s\n", drain_method(&src));
+
+		/* Finished setting up eBPF program */
+		num_data = 0;
+		if (drain)
+			num_data = drain_experiment(&src, cfg.duration, cfg.drain_interval, &report, &output);
+		else
+			wait_experiment(cfg.duration, &report);
+
+		printf("Experiment finished\n");
+		print_seq_stats(seq_map_fd);
+		print_clock_stats(&clock, percpu_counter_fd);
+		if (cfg.hw_rx_timestamp)
+			printf("%llu replies fell back to the kernel clock, no HW RX timestamp\n",
+			       (unsigned long long)sum_percpu_counter(percpu_counter_fd, RX_TS_FALLBACK_KEY));
+
+		/* Collect and save what was not drained yet */
+		len = drain_rings(&src, 0, &output);
+		if (len < 0 || num_data < 0)
+			num_data = -1;
+		else
+			num_data += len;
+		print_drain_stats(&src);
+		stats_print(&stats, false);
+		if (src.data_mmap)
+			munmap_data_map(src.data_mmap);
 	}
-	printf("Collecting %u data points\n", data_len);
-	
-	int num_data = save_data(stats_map_fd, data_len, out_fp);
 
-	printf("%d data points saved to '%s'\n", num_data, cfg.out_file);
-	fclose(out_fp);
-	
-	
-	// struct stamp_data value;
-	// __u32 new_counter;
-
-	// while (1) {
-	// 	if ((bpf_map_lookup_elem(counter_fd, &counter_key, &new_counter)) != 0) {
-	// 		fprintf(stderr, "ERR: %s\n", strerror(errno));
-	// 	}
-	// 	printf("new counter: %u\n", new_counter);
-		
-	// 	if (new_counter > counter){
-	// 		for (__u32 i = counter; i < new_counter; i ++){
-	// 			if ((bpf_map_lookup_elem(stats_map_fd, &i, &value)) != 0) {
-	// 				fprintf(stderr, "ERR: %s\n", strerror(errno));
-	// 			}	
-			
-	// 			printf("[%u]: ssid: %u, seq: %u, tx: %f, rx: %f, RTT: %f\n", i, value.ssid, value.seq, ntp2unix(value.test_tx[0], value.test_tx[1]), uptime2unix(value.reply_rx, time_offset), (uptime2unix(value.reply_rx, time_offset) - ntp2unix(value.test_tx[0], value.test_tx[1])) * 1000);
-	// 		}
-	// 		counter = new_counter;
-	// 	}
-		
-	// 	sleep(interval);
-	// }
+	if (output.pipeline) {
+		__u64 saved = 0;
+
+		if (pipeline_stop(output.pipeline, &saved) != 0)
+			fprintf(stderr, "ERR: failed writing '%s'\n", cfg.out_file);
+		if (num_data >= 0)
+			num_data += saved;
+		if (cfg.write_queue)
+			printf("%llu data points dropped, write queue full\n",
+			       (unsigned long long)output.dropped);
+	}
+	/* The hist mode writes out_fp itself, without a sample writer */
+	if (mode != COLLECT_HIST) {
+		if (writer_close(&writer) != 0)
+			fprintf(stderr, "ERR: failed writing '%s'\n", cfg.out_file);
+		writer_free(&writer);
+		printf("%d data points saved to '%s'%s\n", num_data, cfg.out_file,
+		       rotate ? " segments" : "");
+	}
+	stats_free(&stats);
+	if (out_fp)
+		fclose(out_fp);
+	if (metrics)
+		metrics_stop(metrics);
 	return EXIT_OK;
 }
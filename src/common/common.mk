@@ -46,10 +46,18 @@ BPF_HEADERS := $(wildcard $(HEADER_DIR)/*/*.h) $(wildcard $(INCLUDE_DIR)/*/*.h)
 
 all: llvm-check $(USER_TARGETS) $(XDP_OBJ) $(COPY_LOADER) $(COPY_STATS)
 
-.PHONY: clean $(CLANG) $(LLC)
+.PHONY: clean bench test $(CLANG) $(LLC)
 
 clean:
-	$(Q)rm -f $(USER_TARGETS) $(XDP_OBJ) $(USER_OBJ) $(COPY_LOADER) $(COPY_STATS) *.ll
+	$(Q)rm -f $(USER_TARGETS) $(BENCH_TARGETS) $(TEST_TARGETS) $(XDP_OBJ) $(USER_OBJ) $(LIB_OBJS) $(COPY_LOADER) $(COPY_STATS) *.ll
+
+# Benchmarks are not part of "all", e.g. BENCH_TARGETS := foo_bench
+bench: $(BENCH_TARGETS)
+	$(Q)for BENCH in $^ ; do ./$${BENCH} || exit 1; done
+
+# Tests are not part of "all" either, e.g. TEST_TARGETS := foo_test
+test: $(TEST_TARGETS)
+	$(Q)for TEST in $^ ; do ./$${TEST} || exit 1; done
 
 ifdef COPY_LOADER
 $(LOADER_DIR)/$(COPY_LOADER):
@@ -108,10 +116,17 @@ $(COMMON_H): %.h: %.c
 $(COMMON_OBJS):	%.o: %.h
 	$(Q)$(MAKE) -C $(COMMON_DIR)
 
-$(USER_TARGETS): %: %.c  $(OBJECT_LIBBPF) $(OBJECT_LIBXDP) Makefile $(COMMON_MK) $(COMMON_OBJS) $(KERN_USER_H) $(EXTRA_DEPS)
+# Extra objects of a directory's user programs, e.g. LIB_OBJS := foo.o
+$(LIB_OBJS): %.o: %.c %.h $(OBJECT_LIBBPF) Makefile $(COMMON_MK) $(KERN_USER_H) $(EXTRA_DEPS)
+	$(QUIET_CC)$(CC) -Wall $(CFLAGS) -c -o $@ $<
+
+$(USER_TARGETS): %: %.c  $(OBJECT_LIBBPF) $(OBJECT_LIBXDP) Makefile $(COMMON_MK) $(COMMON_OBJS) $(LIB_OBJS) $(KERN_USER_H) $(EXTRA_DEPS)
 	$(QUIET_CC)$(CC) -Wall $(CFLAGS) $(LDFLAGS) -o $@ $(COMMON_OBJS) $(LIB_OBJS) \
 	 $< $(LDLIBS)
 
+$(BENCH_TARGETS) $(TEST_TARGETS): %: %.c Makefile $(COMMON_MK) $(LIB_OBJS) $(KERN_USER_H) $(EXTRA_DEPS)
+	$(QUIET_CC)$(CC) -Wall -O2 $(CFLAGS) $(LDFLAGS) -o $@ $(LIB_OBJS) $< $(LDLIBS)
+
 $(XDP_OBJ): %.o: %.c  Makefile $(COMMON_MK) $(KERN_USER_H) $(EXTRA_DEPS) $(OBJECT_LIBBPF)
 	$(QUIET_CLANG)$(CLANG) -S \
 	    -target bpf \
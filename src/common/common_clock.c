@@ -0,0 +1,199 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Kernel clock offsets shared with BPF programs, see common_clock.h */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/timex.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "common_clock.h"
+
+static __u64 clock_now_ms(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Offset of clock to CLOCK_REALTIME in ns. The clock is read between two
+ * CLOCK_REALTIME reads, the narrowest of a few tries is kept and half its
+ * width returned in *uncertainty.
+ */
+int measure_clock_offset(clockid_t clock, __s64 *offset, __s64 *uncertainty){
+	struct timespec before, ts, after;
+	__s64 width;
+	int i;
+
+	*uncertainty = INT64_MAX;
+	for (i = 0; i < CLOCK_MEASURE_TRIES; i++) {
+		if (clock_gettime(CLOCK_REALTIME, &before) < 0 ||
+		    clock_gettime(clock, &ts) < 0 ||
+		    clock_gettime(CLOCK_REALTIME, &after) < 0)
+			return -errno;
+
+		width = ((__s64)after.tv_sec - before.tv_sec) * NANOSEC_PER_SEC +
+			((__s64)after.tv_nsec - before.tv_nsec);
+		if (width / 2 >= *uncertainty)
+			continue;
+		*uncertainty = width / 2;
+		*offset = ((__s64)before.tv_sec - ts.tv_sec) * NANOSEC_PER_SEC +
+			  ((__s64)before.tv_nsec - ts.tv_nsec) + width / 2;
+	}
+	return 0;
+}
+
+/* CLOCK_TAI moves with CLOCK_REALTIME, so it is preferred if programs of
+ * prog_type can read it with bpf_ktime_get_tai_ns()
+ */
+bool clock_tai_usable(enum bpf_prog_type prog_type){
+	struct timespec tai_now;
+
+	return clock_gettime(CLOCK_TAI, &tai_now) == 0 &&
+	       libbpf_probe_bpf_helper(prog_type, BPF_FUNC_KTIME_GET_TAI_NS, NULL) == 1;
+}
+
+/* Error Estimate of CLOCK_REALTIME from the kernel's NTP state: S while
+ * synchronized, the estimated error then, the maximum error otherwise
+ */
+__u16 clock_error_est(void){
+	struct timex tx = { .modes = 0 };
+	bool synced;
+	__u64 mult;
+	__u16 scale = 0;
+	int state;
+
+	state = adjtimex(&tx);
+	if (state < 0)
+		return STAMP_ERR_EST_UNKNOWN;
+	synced = state != TIME_ERROR && !(tx.status & STA_UNSYNC);
+
+	/* us to units of 2^-32 s, rounded up, scaled to fit 8 bits */
+	mult = (((__u64)(synced ? tx.esterror : tx.maxerror) << 32) + 999999) / 1000000;
+	while (mult > 0xFF && scale < 0x3F) {
+		mult = (mult + 1) >> 1;
+		scale++;
+	}
+	if (mult > 0xFF)
+		return STAMP_ERR_EST_UNKNOWN;
+	if (mult == 0)
+		mult = 1;
+	return (synced ? STAMP_ERR_EST_S : 0) | scale << 8 | mult;
+}
+
+/* Opens the PTP hardware clock of ifname, its clock id in *clock */
+int phc_open(const char *ifname, clockid_t *clock){
+	struct ethtool_ts_info info = { .cmd = ETHTOOL_GET_TS_INFO };
+	struct ifreq ifr = { .ifr_data = (void *)&info };
+	char path[32];
+	int fd, err;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -errno;
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	err = ioctl(fd, SIOCETHTOOL, &ifr) < 0 ? -errno : 0;
+	close(fd);
+	if (err)
+		return err;
+	if (info.phc_index < 0)
+		return -ENODEV;
+
+	snprintf(path, sizeof(path), "/dev/ptp%d", info.phc_index);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	*clock = FD_TO_CLOCKID(fd);
+	return fd;
+}
+
+int clock_tracker_refresh(struct clock_tracker *ct){
+	static const clockid_t clocks[CLOCK_OFFSET_MAP_SIZE] = {
+		[CLOCK_OFFSET_MONO] = CLOCK_MONOTONIC,
+		[CLOCK_OFFSET_TAI] = CLOCK_TAI,
+	};
+	__s64 offset, uncertainty, step;
+	__u32 key;
+
+	for (key = 0; key < CLOCK_ERROR_EST; key++) {
+		if (key == CLOCK_OFFSET_TAI && !ct->tai)
+			continue;
+		if (measure_clock_offset(clocks[key], &offset, &uncertainty) != 0) {
+			fprintf(stderr, "ERR: reading clock %d: %s\n", clocks[key], strerror(errno));
+			return -1;
+		}
+
+		step = offset > ct->offset[key] ? offset - ct->offset[key] : ct->offset[key] - offset;
+		if (ct->refreshes && step > ct->max_step[key])
+			ct->max_step[key] = step;
+		if (uncertainty > ct->max_uncertainty)
+			ct->max_uncertainty = uncertainty;
+		ct->offset[key] = offset;
+
+		if (bpf_map_update_elem(ct->map_fd, &key, &offset, BPF_EXIST) != 0) {
+			fprintf(stderr, "ERR: updating clock_offset_map: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	key = CLOCK_ERROR_EST;
+	ct->error_est = clock_error_est();
+	offset = ct->error_est;
+	if (bpf_map_update_elem(ct->map_fd, &key, &offset, BPF_EXIST) != 0) {
+		fprintf(stderr, "ERR: updating clock_offset_map: %s\n", strerror(errno));
+		return -1;
+	}
+	/* Last, the programs use the offsets once this is set */
+	if (!ct->refreshes) {
+		key = CLOCK_OFFSET_VALID;
+		offset = 1;
+		if (bpf_map_update_elem(ct->map_fd, &key, &offset, BPF_EXIST) != 0) {
+			fprintf(stderr, "ERR: updating clock_offset_map: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	ct->refreshes++;
+	ct->next = clock_now_ms() + CLOCK_REFRESH_MS;
+	return 0;
+}
+
+/* Have the clock_offset_map of an opened, not yet loaded, object use the
+ * tracker's map. The first call creates that map, or opens the one pinned
+ * for the object, and fills it, so a program never converts its clock
+ * readings with a zero offset. Later calls share it with other objects.
+ */
+int clock_tracker_use(struct clock_tracker *ct, struct bpf_object *obj){
+	struct bpf_map *map = bpf_object__find_map_by_name(obj, "clock_offset_map");
+	const char *pin_path;
+
+	if (!map)
+		return -ENOENT;
+	if (ct->map_fd < 0) {
+		pin_path = bpf_map__pin_path(map);
+		if (pin_path)
+			ct->map_fd = bpf_obj_get(pin_path);
+		if (ct->map_fd < 0)
+			ct->map_fd = bpf_map_create(BPF_MAP_TYPE_ARRAY, "clock_offset_map",
+						    sizeof(__u32), sizeof(__s64),
+						    CLOCK_OFFSET_MAP_SIZE, NULL);
+		if (ct->map_fd < 0)
+			return -errno;
+		if (clock_tracker_refresh(ct) != 0)
+			return -EIO;
+	}
+	return bpf_map__reuse_fd(map, ct->map_fd);
+}
+
+void clock_tracker_tick(struct clock_tracker *ct){
+	if (clock_now_ms() >= ct->next)
+		clock_tracker_refresh(ct);
+}
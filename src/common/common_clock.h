@@ -0,0 +1,45 @@
+/* Kernel clock offsets for BPF programs that timestamp in CLOCK_REALTIME */
+#ifndef __COMMON_CLOCK_H
+#define __COMMON_CLOCK_H
+
+#include <stdbool.h>
+#include <time.h>
+#include <linux/types.h>
+#include <linux/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "../stamp_time.h"
+
+/* clock_offset_map is refreshed this often */
+#define CLOCK_REFRESH_MS 1000
+#define CLOCK_MEASURE_TRIES 5
+/* enum bpf_func_id value, missing from UAPI headers before Linux 6.1 */
+#define BPF_FUNC_KTIME_GET_TAI_NS 208
+/* Dynamic clock id of an open /dev/ptpN */
+#define FD_TO_CLOCKID(fd) ((~(clockid_t)(fd) << 3) | 3)
+
+/* Keeps a clock_offset_map current, so a clock step (or a leap second for
+ * CLOCK_TAI) only affects the timestamps taken before the next refresh.
+ * The largest change of the offset between two refreshes bounds the
+ * conversion error of those timestamps.
+ */
+struct clock_tracker {
+	int map_fd;		/* -1 until clock_tracker_use() */
+	bool tai;		/* The kernel reads CLOCK_TAI, see tai_clock */
+	__u64 next;		/* ms */
+	__u64 refreshes;
+	__s64 offset[CLOCK_OFFSET_MAP_SIZE];
+	__s64 max_step[CLOCK_OFFSET_MAP_SIZE];
+	__s64 max_uncertainty;
+	__u16 error_est;	/* Of CLOCK_REALTIME at the last refresh */
+};
+
+int measure_clock_offset(clockid_t clock, __s64 *offset, __s64 *uncertainty);
+bool clock_tai_usable(enum bpf_prog_type prog_type);
+__u16 clock_error_est(void);
+int phc_open(const char *ifname, clockid_t *clock);
+int clock_tracker_use(struct clock_tracker *ct, struct bpf_object *obj);
+int clock_tracker_refresh(struct clock_tracker *ct);
+void clock_tracker_tick(struct clock_tracker *ct);
+
+#endif /* __COMMON_CLOCK_H */
@@ -6,12 +6,19 @@
 #include <stdbool.h>
 #include <xdp/libxdp.h>
 
+/* --dev may be given this many times */
+#define CONFIG_MAX_DEVS 16
+
 struct config {
 	enum xdp_attach_mode attach_mode;
 	__u32 xdp_flags;
 	int ifindex;
 	char *ifname;
 	char ifname_buf[IF_NAMESIZE];
+	/* Every --dev in order, ifindex and ifname are the last one */
+	int nr_devs;
+	int dev_ifindex[CONFIG_MAX_DEVS];
+	char dev_ifname[CONFIG_MAX_DEVS][IF_NAMESIZE];
 	int redirect_ifindex;
 	char *redirect_ifname;
 	char redirect_ifname_buf[IF_NAMESIZE];
@@ -29,6 +36,26 @@ struct config {
 	bool unload_all;
 	char out_file[512];
 	int duration;
+	char mode[16];
+	int interval;
+	__u16 port_min;
+	__u16 port_max;
+	bool ssid_filter;
+	__u16 ssid_min;
+	__u16 ssid_max;
+	__u8 local_ip_version;
+	__be32 local_ip[4];
+	bool no_seq_tracking;
+	bool hw_rx_timestamp;
+	bool tc_attach;
+	int drain_interval;
+	char format[16];
+	int threads;
+	char metrics_addr[32];
+	int rotate_size;
+	int rotate_interval;
+	int write_queue;
+	bool stateful;
 };
 
 /* Defined in common_params.o */
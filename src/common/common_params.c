@@ -7,6 +7,7 @@
 #include <errno.h>
 
 #include <net/if.h>
+#include <arpa/inet.h>
 #include <linux/if_link.h> /* XDP_FLAGS_* depend on kernel-headers installed */
 #include <linux/if_xdp.h>
 
@@ -57,6 +58,25 @@ void usage(const char *prog_name, const char *doc,
 	printf("\n");
 }
 
+/* Parse "<n>" or "<lo>-<hi>" into an inclusive range of 16-bit values */
+static int parse_u16_range(const char *arg, __u16 *lo, __u16 *hi)
+{
+	unsigned long first, last;
+	char *end;
+
+	errno = 0;
+	first = strtoul(arg, &end, 0);
+	last = first;
+	if (*end == '-')
+		last = strtoul(end + 1, &end, 0);
+	if (errno || *end || end == arg || first > last || last > 0xFFFF)
+		return -1;
+
+	*lo = first;
+	*hi = last;
+	return 0;
+}
+
 int option_wrappers_to_options(const struct option_wrapper *wrapper,
 				struct option **options)
 {
@@ -121,6 +141,13 @@ void parse_cmdline_args(int argc, char **argv,
 					errno, strerror(errno));
 				goto error;
 			}
+			if (cfg->nr_devs == CONFIG_MAX_DEVS) {
+				fprintf(stderr, "ERR: more than %d --dev\n", CONFIG_MAX_DEVS);
+				goto error;
+			}
+			cfg->dev_ifindex[cfg->nr_devs] = cfg->ifindex;
+			strncpy(cfg->dev_ifname[cfg->nr_devs], cfg->ifname, IF_NAMESIZE);
+			cfg->nr_devs++;
 			break;
 		case 'r':
 			if (strlen(optarg) >= IF_NAMESIZE) {
@@ -194,6 +221,108 @@ void parse_cmdline_args(int argc, char **argv,
 		case 4: /* --unload-all */
 			cfg->unload_all = true;
 			break;
+		case 5: /* --mode */
+			if (strlen(optarg) >= sizeof(cfg->mode)) {
+				fprintf(stderr, "ERR: --mode name too long\n");
+				goto error;
+			}
+			dest  = (char *)&cfg->mode;
+			strncpy(dest, optarg, sizeof(cfg->mode));
+			break;
+		case 6: /* --interval */
+			cfg->interval = atoi(optarg);
+			break;
+		case 7: /* --port */
+			if (parse_u16_range(optarg, &cfg->port_min, &cfg->port_max) ||
+			    cfg->port_min == 0) {
+				fprintf(stderr, "ERR: --port invalid port range\n");
+				goto error;
+			}
+			break;
+		case 8: /* --ssid */
+			if (parse_u16_range(optarg, &cfg->ssid_min, &cfg->ssid_max)) {
+				fprintf(stderr, "ERR: --ssid invalid SSID range\n");
+				goto error;
+			}
+			cfg->ssid_filter = true;
+			break;
+		case 9: /* --local-addr */
+			if (inet_pton(AF_INET, optarg, cfg->local_ip) == 1) {
+				cfg->local_ip_version = 4;
+			} else if (inet_pton(AF_INET6, optarg, cfg->local_ip) == 1) {
+				cfg->local_ip_version = 6;
+			} else {
+				fprintf(stderr, "ERR: --local-addr invalid address\n");
+				goto error;
+			}
+			break;
+		case 10: /* --no-seq */
+			cfg->no_seq_tracking = true;
+			break;
+		case 11: /* --hw-timestamp */
+			cfg->hw_rx_timestamp = true;
+			break;
+		case 12: /* --tc */
+			cfg->tc_attach = true;
+			break;
+		case 13: /* --drain */
+			cfg->drain_interval = atoi(optarg);
+			break;
+		case 14: /* --format */
+			if (strlen(optarg) >= sizeof(cfg->format)) {
+				fprintf(stderr, "ERR: --format name too long\n");
+				goto error;
+			}
+			dest  = (char *)&cfg->format;
+			strncpy(dest, optarg, sizeof(cfg->format));
+			break;
+		case 15: /* --threads */
+			cfg->threads = atoi(optarg);
+			if (cfg->threads < 0) {
+				fprintf(stderr, "ERR: --threads must not be negative\n");
+				goto error;
+			}
+			break;
+		case 16: /* --metrics */
+			if (strlen(optarg) >= sizeof(cfg->metrics_addr)) {
+				fprintf(stderr, "ERR: --metrics address too long\n");
+				goto error;
+			}
+			dest  = (char *)&cfg->metrics_addr;
+			strncpy(dest, optarg, sizeof(cfg->metrics_addr));
+			break;
+		case 17: /* --rotate-size */
+			cfg->rotate_size = atoi(optarg);
+			if (cfg->rotate_size < 0) {
+				fprintf(stderr, "ERR: --rotate-size must not be negative\n");
+				goto error;
+			}
+			break;
+		case 18: /* --rotate-interval */
+			cfg->rotate_interval = atoi(optarg);
+			if (cfg->rotate_interval < 0) {
+				fprintf(stderr, "ERR: --rotate-interval must not be negative\n");
+				goto error;
+			}
+			break;
+		case 19: /* --write-queue */
+			cfg->write_queue = atoi(optarg);
+			if (cfg->write_queue < 0) {
+				fprintf(stderr, "ERR: --write-queue must not be negative\n");
+				goto error;
+			}
+			break;
+		case 20: /* --stateful */
+			cfg->stateful = true;
+			break;
+		case 21: /* --pin-dir */
+			if (strlen(optarg) >= sizeof(cfg->pin_dir)) {
+				fprintf(stderr, "ERR: --pin-dir path too long\n");
+				goto error;
+			}
+			dest  = (char *)&cfg->pin_dir;
+			strncpy(dest, optarg, sizeof(cfg->pin_dir));
+			break;
 		case 'h':
 			full_help = true;
 			/* fall-through */
@@ -6,6 +6,7 @@
 #include <errno.h>
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
+#include <bpf/btf.h>
 #include <xdp/libxdp.h>
 
 #include <linux/if_link.h> /* Need XDP flags */
@@ -16,6 +17,11 @@
 #define PATH_MAX	4096
 #endif
 
+/* Older kernel headers, Linux 6.3+ */
+#ifndef BPF_F_XDP_DEV_BOUND_ONLY
+#define BPF_F_XDP_DEV_BOUND_ONLY	(1U << 6)
+#endif
+
 static int reuse_maps(struct bpf_object *obj, const char *path)
 {
 	struct bpf_map *map;
@@ -82,10 +88,8 @@ struct bpf_object *load_bpf_object_file_reuse_maps(const char *file,
 }
 #endif
 
-struct xdp_program *load_bpf_and_xdp_attach(struct config *cfg)
+struct xdp_program *create_xdp_program(struct config *cfg)
 {
-	/* In next assignment this will be moved into ../common/ */
-	int prog_fd = -1;
 	int err;
 
 	DECLARE_LIBBPF_OPTS(bpf_object_open_opts, opts);
@@ -108,29 +112,290 @@ struct xdp_program *load_bpf_and_xdp_attach(struct config *cfg)
 		exit(EXIT_FAIL_BPF);
 	}
 
-	/* At this point: All XDP/BPF programs from the cfg->filename have been
-	 * loaded into the kernel, and evaluated by the verifier. Only one of
-	 * these gets attached to XDP hook, the others will get freed once this
-	 * process exit.
+	/* At this point: the object file is only opened, nothing is loaded
+	 * into the kernel yet. Global data such as .rodata can still be
+	 * modified, see set_rodata_var().
 	 */
+	return prog;
+}
+
+/* Device-bound programs cannot be chained behind the libxdp dispatcher,
+ * which is not bound to the device. They are loaded with libbpf and attached
+ * on their own, without replacing a program already on the device.
+ */
+static void attach_xdp_dev_bound(struct bpf_object *obj, struct bpf_program *bpf_prog,
+				 struct config *cfg)
+{
+	__u32 flags = XDP_FLAGS_UPDATE_IF_NOEXIST;
+	struct bpf_program *pos;
+	int err;
+
+	if (cfg->attach_mode == XDP_MODE_SKB)
+		flags |= XDP_FLAGS_SKB_MODE;
+	else if (cfg->attach_mode == XDP_MODE_NATIVE)
+		flags |= XDP_FLAGS_DRV_MODE;
+	else if (cfg->attach_mode == XDP_MODE_HW)
+		flags |= XDP_FLAGS_HW_MODE;
+
+	/* Only the bound program is loaded into the kernel */
+	bpf_object__for_each_program(pos, obj)
+		bpf_program__set_autoload(pos, pos == bpf_prog);
+	err = bpf_object__load(obj);
+	if (err) {
+		fprintf(stderr, "ERR: loading BPF-OBJ file(%s) (%d): %s\n",
+			cfg->filename, err, strerror(-err));
+		exit(EXIT_FAIL_BPF);
+	}
+
+	err = bpf_xdp_attach(cfg->ifindex, bpf_program__fd(bpf_prog), flags, NULL);
+	if (err) {
+		fprintf(stderr, "ERR: attaching device-bound XDP program on %s: %s\n",
+			cfg->ifname, strerror(-err));
+		exit(EXIT_FAIL_XDP);
+	}
+}
+
+void attach_xdp_program(struct xdp_program *prog, struct config *cfg)
+{
+	struct bpf_program *bpf_prog;
+	int prog_fd = -1;
+	int err;
 
-	/* At this point: BPF-progs are (only) loaded by the kernel, and prog_fd
-	 * is our select file-descriptor handle. Next step is attaching this FD
-	 * to a kernel hook point, in this case XDP net_device link-level hook.
+	bpf_prog = bpf_object__find_program_by_name(xdp_program__bpf_obj(prog),
+						    xdp_program__name(prog));
+	if (bpf_prog && bpf_program__flags(bpf_prog) & BPF_F_XDP_DEV_BOUND_ONLY) {
+		attach_xdp_dev_bound(xdp_program__bpf_obj(prog), bpf_prog, cfg);
+		return;
+	}
+
+	/* Attaching loads all XDP/BPF programs from cfg->filename into the
+	 * kernel, where they are evaluated by the verifier. Only one of
+	 * these gets attached to XDP hook, the others will get freed once this
+	 * process exit.
 	 */
 	err = xdp_program__attach(prog, cfg->ifindex, cfg->attach_mode, 0);
 	if (err)
 		exit(err);
 
+	/* At this point: BPF-progs are loaded by the kernel, and prog_fd
+	 * is our select file-descriptor handle, attached to the XDP
+	 * net_device link-level hook.
+	 */
 	prog_fd = xdp_program__fd(prog);
 	if (prog_fd < 0) {
 		fprintf(stderr, "ERR: xdp_program__fd failed: %s\n", strerror(errno));
 		exit(EXIT_FAIL_BPF);
 	}
+}
 
+/* Kernel id of an attached program, also of a device-bound one that libxdp
+ * did not load itself
+ */
+__u32 attached_xdp_prog_id(struct xdp_program *prog)
+{
+	struct bpf_prog_info info = {};
+	__u32 info_len = sizeof(info);
+	struct bpf_program *bpf_prog;
+
+	if (xdp_program__id(prog))
+		return xdp_program__id(prog);
+	bpf_prog = bpf_object__find_program_by_name(xdp_program__bpf_obj(prog),
+						    xdp_program__name(prog));
+	if (!bpf_prog || bpf_obj_get_info_by_fd(bpf_program__fd(bpf_prog), &info, &info_len))
+		return 0;
+	return info.id;
+}
+
+struct xdp_program *load_bpf_and_xdp_attach(struct config *cfg)
+{
+	struct xdp_program *prog = create_xdp_program(cfg);
+
+	attach_xdp_program(prog, cfg);
 	return prog;
 }
 
+/* tc (clsact ingress) attach, for drivers with poor native XDP support.
+ * Our filter uses a fixed handle and priority so do_tc_unload() can find it
+ * again without touching other filters on the device.
+ */
+#define TC_HANDLE	0x5354 /* "ST" */
+#define TC_PRIORITY	1
+
+struct bpf_object *open_bpf_object_file(struct config *cfg)
+{
+	struct bpf_program *prog;
+	struct bpf_object *obj;
+	int err;
+
+	obj = bpf_object__open_file(cfg->filename, NULL);
+	err = libbpf_get_error(obj);
+	if (err) {
+		fprintf(stderr, "ERR: opening BPF-OBJ file(%s) (%d): %s\n",
+			cfg->filename, err, strerror(-err));
+		exit(EXIT_FAIL_BPF);
+	}
+
+	/* Only the selected program is loaded into the kernel */
+	if (!bpf_object__find_program_by_name(obj, cfg->progname)) {
+		fprintf(stderr, "ERR: program %s not found in %s\n",
+			cfg->progname, cfg->filename);
+		exit(EXIT_FAIL_BPF);
+	}
+	bpf_object__for_each_program(prog, obj)
+		bpf_program__set_autoload(prog, !strcmp(bpf_program__name(prog), cfg->progname));
+
+	return obj;
+}
+
+void attach_tc_program(struct bpf_object *obj, struct config *cfg)
+{
+	DECLARE_LIBBPF_OPTS(bpf_tc_hook, hook, .ifindex = cfg->ifindex,
+			    .attach_point = BPF_TC_INGRESS);
+	DECLARE_LIBBPF_OPTS(bpf_tc_opts, opts, .handle = TC_HANDLE,
+			    .priority = TC_PRIORITY, .flags = BPF_TC_F_REPLACE);
+	int err;
+
+	err = bpf_object__load(obj);
+	if (err) {
+		fprintf(stderr, "ERR: loading BPF-OBJ file(%s) (%d): %s\n",
+			cfg->filename, err, strerror(-err));
+		exit(EXIT_FAIL_BPF);
+	}
+
+	/* The clsact qdisc may already exist, e.g. from another user */
+	err = bpf_tc_hook_create(&hook);
+	if (err && err != -EEXIST) {
+		fprintf(stderr, "ERR: creating clsact qdisc on %s: %s\n",
+			cfg->ifname, strerror(-err));
+		exit(EXIT_FAIL_BPF);
+	}
+
+	opts.prog_fd = bpf_program__fd(bpf_object__find_program_by_name(obj, cfg->progname));
+	err = bpf_tc_attach(&hook, &opts);
+	if (err) {
+		fprintf(stderr, "ERR: attaching tc program on %s: %s\n",
+			cfg->ifname, strerror(-err));
+		exit(EXIT_FAIL_BPF);
+	}
+}
+
+int do_tc_unload(struct config *cfg)
+{
+	DECLARE_LIBBPF_OPTS(bpf_tc_hook, hook, .ifindex = cfg->ifindex,
+			    .attach_point = BPF_TC_INGRESS);
+	DECLARE_LIBBPF_OPTS(bpf_tc_opts, opts, .handle = TC_HANDLE,
+			    .priority = TC_PRIORITY);
+	int err;
+
+	err = bpf_tc_detach(&hook, &opts);
+	if (err) {
+		fprintf(stderr, "Unable to detach tc program from %s: %s\n",
+			cfg->ifname, strerror(-err));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Bind an opened program to the device it will be attached to, which is
+ * required for XDP RX metadata kfuncs such as bpf_xdp_metadata_rx_timestamp.
+ * attach_xdp_program() then attaches it without the libxdp dispatcher.
+ */
+int set_xdp_dev_bound(struct xdp_program *prog, int ifindex)
+{
+	struct bpf_program *bpf_prog;
+	int err;
+
+	bpf_prog = bpf_object__find_program_by_name(xdp_program__bpf_obj(prog),
+						    xdp_program__name(prog));
+	if (!bpf_prog)
+		return -ENOENT;
+
+	err = bpf_program__set_ifindex(bpf_prog, ifindex);
+	if (err)
+		return err;
+	return bpf_program__set_flags(bpf_prog, bpf_program__flags(bpf_prog) |
+					       BPF_F_XDP_DEV_BOUND_ONLY);
+}
+
+/* Overwrite a const volatile global of an opened, not yet loaded, object.
+ * The variable is looked up by name in the BTF description of .rodata.
+ */
+int set_rodata_var(struct bpf_object *obj, const char *name,
+		   const void *value, size_t size)
+{
+	const struct btf_var_secinfo *vsi;
+	const struct btf_type *sec, *var;
+	struct bpf_map *map = NULL, *pos;
+	struct btf *btf;
+	size_t map_size;
+	char *rodata;
+	int sec_id, i;
+
+	/* Internal maps are named after the object, e.g. "collecto.rodata" */
+	bpf_object__for_each_map(pos, obj) {
+		const char *map_name = strstr(bpf_map__name(pos), ".rodata");
+
+		if (map_name && !strcmp(map_name, ".rodata")) {
+			map = pos;
+			break;
+		}
+	}
+	btf = bpf_object__btf(obj);
+	if (!map || !btf)
+		return -ENOENT;
+
+	rodata = bpf_map__initial_value(map, &map_size);
+	if (!rodata)
+		return -EINVAL;
+
+	sec_id = btf__find_by_name_kind(btf, ".rodata", BTF_KIND_DATASEC);
+	if (sec_id < 0)
+		return sec_id;
+	sec = btf__type_by_id(btf, sec_id);
+
+	vsi = btf_var_secinfos(sec);
+	for (i = 0; i < btf_vlen(sec); i++, vsi++) {
+		var = btf__type_by_id(btf, vsi->type);
+		if (strcmp(btf__name_by_offset(btf, var->name_off), name))
+			continue;
+		if (vsi->size != size || vsi->offset + size > map_size)
+			return -EINVAL;
+		memcpy(rodata + vsi->offset, value, size);
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/* Apply the STAMP packet filters from the command line, shared by the
+ * collector and reflector programs. Options not given keep the defaults
+ * compiled into the object.
+ */
+int set_stamp_filter_rodata(struct bpf_object *obj, const struct config *cfg)
+{
+	int err = 0;
+
+	if (cfg->port_max) {
+		err = set_rodata_var(obj, "stamp_port_min", &cfg->port_min, sizeof(cfg->port_min));
+		if (!err)
+			err = set_rodata_var(obj, "stamp_port_max", &cfg->port_max, sizeof(cfg->port_max));
+	}
+	if (!err && cfg->ssid_filter) {
+		err = set_rodata_var(obj, "ssid_min", &cfg->ssid_min, sizeof(cfg->ssid_min));
+		if (!err)
+			err = set_rodata_var(obj, "ssid_max", &cfg->ssid_max, sizeof(cfg->ssid_max));
+	}
+	if (!err && cfg->local_ip_version) {
+		err = set_rodata_var(obj, "local_ip_version", &cfg->local_ip_version,
+				     sizeof(cfg->local_ip_version));
+		if (!err && cfg->local_ip_version == 4)
+			err = set_rodata_var(obj, "local_ipv4", &cfg->local_ip[0], sizeof(cfg->local_ip[0]));
+		else if (!err)
+			err = set_rodata_var(obj, "local_ipv6", cfg->local_ip, sizeof(cfg->local_ip));
+	}
+
+	return err;
+}
 
 #define XDP_UNKNOWN	XDP_REDIRECT + 1
 #ifndef XDP_ACTION_MAX
@@ -3,8 +3,20 @@
 #define __COMMON_USER_BPF_XDP_H
 
 struct bpf_object *load_bpf_object_file(const char *filename, int ifindex);
+struct xdp_program *create_xdp_program(struct config *cfg);
+void attach_xdp_program(struct xdp_program *prog, struct config *cfg);
+__u32 attached_xdp_prog_id(struct xdp_program *prog);
 struct xdp_program *load_bpf_and_xdp_attach(struct config *cfg);
 
+struct bpf_object *open_bpf_object_file(struct config *cfg);
+void attach_tc_program(struct bpf_object *obj, struct config *cfg);
+int do_tc_unload(struct config *cfg);
+
+int set_xdp_dev_bound(struct xdp_program *prog, int ifindex);
+int set_rodata_var(struct bpf_object *obj, const char *name,
+		   const void *value, size_t size);
+int set_stamp_filter_rodata(struct bpf_object *obj, const struct config *cfg);
+
 const char *action2str(__u32 action);
 
 int check_map_fd_info(const struct bpf_map_info *info,
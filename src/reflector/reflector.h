@@ -0,0 +1,38 @@
+#include <linux/bpf.h>
+
+#ifndef REFLECTOR_H
+#define REFLECTOR_H
+
+#include "../stamp_time.h"
+
+// Sessions the stateful reflector keeps a sequence counter for, the least
+// recently used ones are evicted beyond that
+#define REFLECTOR_MAX_SESSIONS 262144
+
+// SSIDs counted in ssid_stats_map, the least recently used ones are
+// evicted beyond that
+#define REFLECTOR_MAX_SSIDS 4096
+
+/* Keys of phc_offset_map, --hw-timestamp only */
+enum phc_offset_key {
+    PHC_OFFSET,         /* CLOCK_REALTIME - the NIC's PTP hardware clock */
+    PHC_OFFSET_VALID,   /* Non-zero once PHC_OFFSET is written, which may
+                         * be 0 for a PHC kept at UTC */
+    PHC_OFFSET_MAP_SIZE
+};
+
+/* Key of reflector_session_map: a STAMP session is its UDP 5-tuple and
+ * SSID (RFC 8762). IPv4 addresses are in the first word, the others zero.
+ */
+struct reflector_session_key
+{
+    __be32 saddr[4];
+    __be32 daddr[4];
+    __be16 sport;
+    __be16 dport;
+    __be16 ssid;
+    __u8 ip_version;    /* 4 or 6 */
+    __u8 pad;
+};
+
+#endif /* REFLECTOR_H */
@@ -1,15 +1,112 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 #include <linux/if_ether.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/in.h>
 #include <linux/udp.h>
 #include <linux/bpf.h>
+#include <linux/pkt_cls.h>
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_endian.h>
 
 #include "../common/parsing_helpers.h"
+#include "../common/rewrite_helpers.h"
+#include "../common/xdp_stats_kern_user.h"
+#include "../common/xdp_stats_kern.h"
 #include "../stamp.h"
+#include "../stamp_time.h"
+#include "reflector.h"
 
+/* Load-time configuration, written into .rodata by the loader before the
+ * program is loaded. The defaults reflect every STAMP test packet sent to
+ * port 862.
+ */
+const volatile __u16 stamp_port_min = STAMP_PORT;
+const volatile __u16 stamp_port_max = STAMP_PORT;
+const volatile __u16 ssid_min = 0;
+const volatile __u16 ssid_max = 0xFFFF;
+const volatile __u8 local_ip_version = 0;	/* 0: any destination, 4 or 6 */
+const volatile __be32 local_ipv4 = 0;
+const volatile __be32 local_ipv6[4] = {};
+const volatile __u8 hw_rx_timestamp = 0;
+const volatile __u8 tai_clock = 0;	/* bpf_ktime_get_tai_ns() exists (6.1+) */
+const volatile __u8 stateful = 0;	/* Own sequence numbers, see next_session_seq() */
+const volatile __u8 sync_source = STAMP_SYNC_NTP;	/* Timestamp Information TLV */
+
+/* TLVs processed per test packet, and sub-TLVs per Location TLV */
+#define STAMP_MAX_TLVS 8
+#define STAMP_MAX_SUB_TLVS 4
+#define STAMP_TLV_END_MAX (sizeof(struct stamp_test_pkt) + STAMP_TLV_AREA_MAX)
+
+/* XDP RX metadata kfunc (Linux 6.3+), only usable by device-bound programs */
+extern int bpf_xdp_metadata_rx_timestamp(const struct xdp_md *ctx,
+					 __u64 *timestamp) __ksym __weak;
+
+/* Offsets of the kernel clocks to CLOCK_REALTIME in ns and the clock's
+ * Error Estimate, by enum clock_offset_key, refreshed by reflector_user
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, __s64);
+	__uint(max_entries, CLOCK_OFFSET_MAP_SIZE);
+} clock_offset_map SEC(".maps");
+
+/* With hw_rx_timestamp: offset of the PTP hardware clock of the device to
+ * CLOCK_REALTIME in ns, by enum phc_offset_key, refreshed by reflector_user
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, __s64);
+	__uint(max_entries, PHC_OFFSET_MAP_SIZE);
+} phc_offset_map SEC(".maps");
+
+/* Stateful mode: the next sequence number of every session. One counter
+ * per session shared by all CPUs, incremented atomically: the packets of a
+ * session reach several CPUs once RSS rehashes it, in generic XDP or on tc.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, struct reflector_session_key);
+	__type(value, __u32);
+	__uint(max_entries, REFLECTOR_MAX_SESSIONS);
+} reflector_session_map SEC(".maps");
+
+/* Replies sent per SSID, xdp_stats_map counts every packet by action */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+	__type(key, __u16);
+	__type(value, struct datarec);
+	__uint(max_entries, REFLECTOR_MAX_SSIDS);
+} ssid_stats_map SEC(".maps");
+
+static __always_inline void ssid_stats_record(__be16 ssid, __u64 bytes)
+{
+	__u16 key = bpf_ntohs(ssid);
+	struct datarec *rec = bpf_map_lookup_elem(&ssid_stats_map, &key);
+	struct datarec first = { .rx_packets = 1, .rx_bytes = bytes };
+
+	if (rec) {
+		rec->rx_packets++;
+		rec->rx_bytes += bytes;
+	} else {
+		bpf_map_update_elem(&ssid_stats_map, &key, &first, BPF_ANY);
+	}
+}
+
+/* xdp_stats_record_action() for the tc program, which counts its packets
+ * under the XDP action it stands in for
+ */
+static __always_inline void tc_stats_record_action(struct __sk_buff *skb, __u32 action)
+{
+	struct datarec *rec = bpf_map_lookup_elem(&xdp_stats_map, &action);
+
+	if (!rec)
+		return;
+	rec->rx_packets++;
+	rec->rx_bytes += skb->len;
+}
 
 //compute new checksum
 static __always_inline __u16 csum_fold_helper(__u64 csum) {
@@ -21,83 +118,437 @@ static __always_inline __u16 csum_fold_helper(__u64 csum) {
     return ~csum;
 }
 
-static __always_inline __u64 csum_add(__u64 csum, __u64 addend) {
-    csum += addend;
-    return csum + (csum < addend);
+/* reflector_user has written clock_offset_map. Before that the kernel
+ * clock readings would not be wall-clock times.
+ */
+static __always_inline int clock_offsets_valid(void)
+{
+	__u32 key = CLOCK_OFFSET_VALID;
+	__s64 *valid = bpf_map_lookup_elem(&clock_offset_map, &key);
+
+	return valid && *valid;
+}
+
+/* The kernel clock now, in ns since the Unix epoch. CLOCK_TAI only differs
+ * from CLOCK_REALTIME by the TAI-UTC offset, so it is preferred when
+ * available; CLOCK_MONOTONIC is converted with the last offset userspace
+ * measured, see clock_offsets_valid().
+ */
+static __always_inline __u64 get_kernel_ns(void)
+{
+	__u32 key = tai_clock ? CLOCK_OFFSET_TAI : CLOCK_OFFSET_MONO;
+	__u64 now = tai_clock ? bpf_ktime_get_tai_ns() : bpf_ktime_get_ns();
+	__s64 *offset;
+
+	offset = bpf_map_lookup_elem(&clock_offset_map, &key);
+	return stamp_ktime_to_ns(now, offset ? *offset : 0);
+}
+
+/* Receive time of the test packet. With hw_rx_timestamp the driver's RX
+ * timestamp is used when available, converted from the NIC's PTP hardware
+ * clock like the kernel clock is, otherwise the kernel clock is read now.
+ * method tells which, see enum stamp_timestamp_method. ctx is NULL for tc,
+ * which has no RX metadata.
+ */
+static __always_inline __u64 get_test_rx(struct xdp_md *ctx, __u8 *method)
+{
+	__u32 key = PHC_OFFSET, valid_key = PHC_OFFSET_VALID;
+	__s64 *offset, *valid;
+	__u64 timestamp = 0;
+
+	if (hw_rx_timestamp && ctx && bpf_ksym_exists(bpf_xdp_metadata_rx_timestamp) &&
+	    bpf_xdp_metadata_rx_timestamp(ctx, &timestamp) == 0 && timestamp) {
+		valid = bpf_map_lookup_elem(&phc_offset_map, &valid_key);
+		offset = bpf_map_lookup_elem(&phc_offset_map, &key);
+		if (valid && *valid && offset) {
+			*method = STAMP_TIMESTAMP_HW;
+			return timestamp + *offset;
+		}
+	}
+	*method = STAMP_TIMESTAMP_SW;
+	return get_kernel_ns();
+}
+
+/* Error Estimate of the reply: the reflector's own clock as reflector_user
+ * last measured it, with the Z flag of the sender's format the timestamps
+ * are written in
+ */
+static __always_inline __be16 reply_error_est(__be16 sender_error_est)
+{
+	__u32 key = CLOCK_ERROR_EST;
+	__s64 *est = bpf_map_lookup_elem(&clock_offset_map, &key);
+	__u16 own = est && *est ? (__u16)*est : STAMP_ERR_EST_UNKNOWN;
+
+	return bpf_htons((own & ~STAMP_ERR_EST_Z) |
+			 (bpf_ntohs(sender_error_est) & STAMP_ERR_EST_Z));
+}
+
+/* A test packet being reflected. Offsets are from the start of the STAMP
+ * packet, which is at an even offset of the UDP checksum.
+ */
+struct reflect_state {
+	void *pkt;
+	void *data_end;
+	__u32 end;		/* Offset the STAMP packet with its TLVs ends at */
+	struct ethhdr *eth;
+	struct iphdr *ipv4;
+	struct ipv6hdr *ipv6;
+	struct udphdr *udp;
+	__u8 rx_method;		/* enum stamp_timestamp_method */
+	__u8 counted;		/* seq is valid */
+	__u32 seq;		/* Reflector's sequence number in the session */
+	__u32 csum;		/* Sum of the UDP checksum changes by the TLVs */
+	struct reflector_session_key session;
+};
+
+/* Stateful mode: the reflector's sequence number for the session, counting
+ * from 0 (RFC 8762, 4.3.1). A session evicted from the LRU starts over.
+ */
+static __always_inline __u32 next_session_seq(struct reflector_session_key *key)
+{
+	__u32 *next = bpf_map_lookup_elem(&reflector_session_map, key);
+	__u32 first = 1;
+
+	if (!next) {
+		/* A new session, unless another CPU just added it */
+		if (bpf_map_update_elem(&reflector_session_map, key, &first, BPF_NOEXIST) == 0)
+			return 0;
+		next = bpf_map_lookup_elem(&reflector_session_map, key);
+		if (!next)
+			return 0;
+	}
+	return __sync_fetch_and_add(next, 1);
+}
+
+/* The session counter of the test packet, counted once per packet. Must be
+ * called before the addresses are swapped.
+ */
+static __always_inline __u32 session_seq(struct reflect_state *st)
+{
+	struct reflector_session_key *key = &st->session;
+
+	if (st->counted)
+		return st->seq;
+	if (st->ipv4) {
+		key->saddr[0] = st->ipv4->saddr;
+		key->daddr[0] = st->ipv4->daddr;
+		key->ip_version = 4;
+	} else {
+		__builtin_memcpy(key->saddr, &st->ipv6->saddr, sizeof(key->saddr));
+		__builtin_memcpy(key->daddr, &st->ipv6->daddr, sizeof(key->daddr));
+		key->ip_version = 6;
+	}
+	key->sport = st->udp->source;
+	key->dport = st->udp->dest;
+	key->ssid = ((struct stamp_test_pkt *)st->pkt)->ssid;
+	st->seq = next_session_seq(key);
+	st->counted = 1;
+	return st->seq;
+}
+
+/* A byte at offset off as part of the 16-bit checksum word it falls in,
+ * even offsets being the first byte of a word in memory
+ */
+static __always_inline __u16 csum_byte(__u8 b, __u32 off)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return off & 1 ? (__u16)b << 8 : b;
+#else
+	return off & 1 ? b : (__u16)b << 8;
+#endif
+}
+
+/* Copy len bytes to dst at offset off, adding the change to the checksum
+ * sum. TLVs have no alignment, so this works byte by byte (RFC 1624).
+ */
+static __always_inline void csum_store(__u32 *sum, __u8 *dst, __u32 off,
+				       const __u8 *src, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		*sum += (__u16)~csum_byte(dst[i], off + i) + csum_byte(src[i], off + i);
+		dst[i] = src[i];
+	}
+}
+
+/* Set the U, M and I flags of a (sub-)TLV at off as given, the others are
+ * kept
+ */
+static __always_inline void tlv_set_flags(struct reflect_state *st, struct stamp_tlv_hdr *tlv,
+					  __u32 off, __u8 flags)
+{
+	__u8 new = (tlv->flags & ~(STAMP_TLV_FLAG_U | STAMP_TLV_FLAG_M | STAMP_TLV_FLAG_I)) | flags;
+
+	csum_store(&st->csum, &tlv->flags, off, &new, 1);
 }
 
-static __always_inline __u64 csum_sub(__u64 csum, __u64 addend) {
-    return csum_add(csum, ~addend);
+/* Fill a Location sub-TLV value of len bytes at off from the test packet
+ * headers. Returns the flags of the sub-TLV.
+ */
+static __always_inline __u8 fill_location_sub_tlv(struct reflect_state *st, __u8 type,
+						  __u32 off, __u32 len)
+{
+	__u8 *val = st->pkt + off;
+
+	switch (type) {
+	case STAMP_SUB_TLV_SRC_MAC:
+		if (len < ETH_ALEN || val + ETH_ALEN > st->data_end)
+			return STAMP_TLV_FLAG_M;
+		csum_store(&st->csum, val, off, st->eth->h_source, ETH_ALEN);
+		return 0;
+	case STAMP_SUB_TLV_DEST_IPV4:
+	case STAMP_SUB_TLV_SRC_IPV4:
+		/* Malformed if the test packet is IPv6 */
+		if (!st->ipv4 || len != 4 || val + 4 > st->data_end)
+			return STAMP_TLV_FLAG_M;
+		csum_store(&st->csum, val, off, type == STAMP_SUB_TLV_SRC_IPV4 ?
+			   (__u8 *)&st->ipv4->saddr : (__u8 *)&st->ipv4->daddr, 4);
+		return 0;
+	case STAMP_SUB_TLV_DEST_IPV6:
+	case STAMP_SUB_TLV_SRC_IPV6:
+		if (!st->ipv6 || len != 16 || val + 16 > st->data_end)
+			return STAMP_TLV_FLAG_M;
+		csum_store(&st->csum, val, off, type == STAMP_SUB_TLV_SRC_IPV6 ?
+			   (__u8 *)&st->ipv6->saddr : (__u8 *)&st->ipv6->daddr, 16);
+		return 0;
+	}
+	return STAMP_TLV_FLAG_U;
 }
 
-static __always_inline void update_checksum(__u16 *csum, __u16 old, __u16 new) {
-    __u64 cs = *csum;
-    cs = csum_sub(cs, ~(((__u64)old) << 16));
-    cs = csum_add(cs, ((__u64)new) << 16);
-    *csum = csum_fold_helper(cs);
+/* Location TLV: the UDP ports of the test packet, then its addresses in
+ * the sub-TLVs the sender asked for
+ */
+static __always_inline __u8 fill_location(struct reflect_state *st, __u32 off, __u32 len)
+{
+	struct stamp_tlv_location loc = {
+		.dest_port = st->udp->dest,
+		.src_port = st->udp->source,
+	};
+	struct stamp_tlv_hdr *sub;
+	__u32 end = off + len;
+	__u32 sub_len;
+	__u8 *val = st->pkt + off;
+	int i;
+
+	if (len < sizeof(loc) || val + sizeof(loc) > st->data_end)
+		return STAMP_TLV_FLAG_M;
+	csum_store(&st->csum, val, off, (__u8 *)&loc, sizeof(loc));
+	off += sizeof(loc);
+
+	for (i = 0; i < STAMP_MAX_SUB_TLVS; i++) {
+		if (off > STAMP_TLV_END_MAX || off + sizeof(*sub) > end)
+			break;
+		sub = st->pkt + off;
+		if (sub + 1 > st->data_end)
+			break;
+		sub_len = bpf_ntohs(sub->length);
+		if (off + sizeof(*sub) + sub_len > end)
+			return STAMP_TLV_FLAG_M;
+		tlv_set_flags(st, sub, off,
+			      fill_location_sub_tlv(st, sub->type, off + sizeof(*sub), sub_len));
+		off += sizeof(*sub) + sub_len;
+	}
+	return 0;
 }
 
+/* Timestamp Information TLV: how the reflector's timestamps were taken */
+static __always_inline __u8 fill_timestamp_info(struct reflect_state *st, __u32 off, __u32 len)
+{
+	struct stamp_tlv_timestamp_info info = {
+		.sync_src_in = sync_source,
+		.timestamp_in = st->rx_method,
+		.sync_src_out = sync_source,
+		.timestamp_out = STAMP_TIMESTAMP_SW,
+	};
+	__u8 *val = st->pkt + off;
+
+	if (len < sizeof(info) || val + sizeof(info) > st->data_end)
+		return STAMP_TLV_FLAG_M;
+	csum_store(&st->csum, val, off, (__u8 *)&info, sizeof(info));
+	return 0;
+}
 
-/*
- * Swaps destination and source MAC addresses inside an Ethernet header
+/* Class of Service TLV: report the DSCP and ECN the test packet arrived
+ * with and send the reply with the DSCP the sender asked for (RP = 0)
  */
-static __always_inline void swap_src_dst_mac(struct ethhdr *eth)
+static __always_inline __u8 fill_cos(struct reflect_state *st, __u32 off, __u32 len)
 {
-	__u8 h_tmp[ETH_ALEN];
+	struct stamp_tlv_cos *cos = st->pkt + off;
+	__u8 *ip6 = (__u8 *)st->ipv6;
+	__u8 tos, dscp1, new_tos;
+	__be16 val;
+	__u32 ip_csum = 0;
+
+	if (len != sizeof(*cos) || cos + 1 > st->data_end)
+		return STAMP_TLV_FLAG_M;
+	if (st->ipv4)
+		tos = st->ipv4->tos;
+	else
+		tos = (ip6[0] & 0x0f) << 4 | ip6[1] >> 4;
+	dscp1 = bpf_ntohs(cos->dscp_ecn_rp) >> 10;
+	val = bpf_htons((__u16)dscp1 << 10 | (__u16)(tos >> 2) << 4 | (tos & 0x3) << 2);
+	csum_store(&st->csum, (__u8 *)&cos->dscp_ecn_rp, off, (__u8 *)&val, sizeof(val));
+
+	new_tos = dscp1 << 2 | (tos & 0x3);
+	if (st->ipv4) {
+		/* tos is the second byte of the IPv4 header */
+		csum_store(&ip_csum, &st->ipv4->tos, 1, &new_tos, 1);
+		st->ipv4->check = csum_fold_helper((__u16)~st->ipv4->check + (__u64)ip_csum);
+	} else {
+		ip6[0] = (ip6[0] & 0xf0) | new_tos >> 4;
+		ip6[1] = (ip6[1] & 0x0f) | new_tos << 4;
+	}
+	return 0;
+}
 
-	__builtin_memcpy(h_tmp, eth->h_source, ETH_ALEN);
-	__builtin_memcpy(eth->h_source, eth->h_dest, ETH_ALEN);
-	__builtin_memcpy(eth->h_dest, h_tmp, ETH_ALEN);
+/* Direct Measurement TLV: test packets received and replies sent in the
+ * session, both counting this one. Only a stateful reflector keeps these
+ * counters; a stateless one zeroes them and flags the TLV U, as a
+ * Session-Reflector not supporting it does (RFC 8972, 4.5).
+ */
+static __always_inline __u8 fill_direct_measurement(struct reflect_state *st, __u32 off, __u32 len)
+{
+	struct stamp_tlv_direct_measurement *dm = st->pkt + off;
+	__be32 count[2] = {};
+
+	if (len != sizeof(*dm) || dm + 1 > st->data_end)
+		return STAMP_TLV_FLAG_M;
+	if (stateful) {
+		count[0] = bpf_htonl(session_seq(st) + 1);
+		count[1] = count[0];
+	}
+	csum_store(&st->csum, (__u8 *)&dm->reflector_rx, off + 4, (__u8 *)count, sizeof(count));
+	return stateful ? 0 : STAMP_TLV_FLAG_U;
 }
 
-/*
- * Swaps destination and source IPv4 addresses inside an IPv4 header
+/* Fill in the TLVs following the base test packet (RFC 8972) and flag the
+ * ones not understood (U) or malformed (M). A TLV whose Length runs past
+ * the packet ends the parsing, TLVs past STAMP_MAX_TLVS or
+ * STAMP_TLV_AREA_MAX are reflected unchanged, with the U flag the sender
+ * set.
  */
-static __always_inline void swap_src_dst_ipv4(struct iphdr *iphdr)
+static __always_inline void process_tlvs(struct reflect_state *st)
 {
-	__be32 tmp = iphdr->saddr;
+	struct stamp_tlv_hdr *tlv;
+	__u32 off = sizeof(struct stamp_test_pkt);
+	__u32 len;
+	__u8 flags;
+	int i;
+
+	for (i = 0; i < STAMP_MAX_TLVS; i++) {
+		if (off > STAMP_TLV_END_MAX || off + sizeof(*tlv) > st->end)
+			break;
+		tlv = st->pkt + off;
+		if (tlv + 1 > st->data_end)
+			break;
+		len = bpf_ntohs(tlv->length);
+		if (off + sizeof(*tlv) + len > st->end) {
+			tlv_set_flags(st, tlv, off, STAMP_TLV_FLAG_M);
+			break;
+		}
+
+		switch (tlv->type) {
+		case STAMP_TLV_EXTRA_PADDING:
+			flags = 0;
+			break;
+		case STAMP_TLV_LOCATION:
+			flags = fill_location(st, off + sizeof(*tlv), len);
+			break;
+		case STAMP_TLV_TIMESTAMP_INFO:
+			flags = fill_timestamp_info(st, off + sizeof(*tlv), len);
+			break;
+		case STAMP_TLV_CLASS_OF_SERVICE:
+			flags = fill_cos(st, off + sizeof(*tlv), len);
+			break;
+		case STAMP_TLV_DIRECT_MEASUREMENT:
+			flags = fill_direct_measurement(st, off + sizeof(*tlv), len);
+			break;
+		default:
+			/* Including the HMAC TLV, authentication is not supported */
+			flags = STAMP_TLV_FLAG_U;
+		}
+		tlv_set_flags(st, tlv, off, flags);
+		off += sizeof(*tlv) + len;
+	}
+}
 
-	iphdr->saddr = iphdr->daddr;
-	iphdr->daddr = tmp;
+/* Store ns in a packet timestamp, in the format the Error Estimate selects */
+static __always_inline void store_timestamp(__be32 *dst, __u64 ns, __be16 error_est)
+{
+	__u64 ts = bpf_ntohs(error_est) & STAMP_ERR_EST_Z ? stamp_ns_to_ptp(ns) :
+							     stamp_ns_to_ntp(ns);
+
+	dst[0] = bpf_htonl(ts >> 32);
+	dst[1] = bpf_htonl((__u32)ts);
 }
 
-static __always_inline struct stamp_reply_pkt* rewrite_stamp_packet(struct hdr_cursor *nh, void *data_end){
+/* ctx is the XDP context for its RX timestamp, NULL for tc */
+static __always_inline struct stamp_reply_pkt* rewrite_stamp_packet(struct hdr_cursor *nh, void *data_end,
+								    struct xdp_md *ctx){
 
 	struct ethhdr *eth_hdr;
-	struct iphdr *ipv4_hdr;
+	struct iphdr *ipv4_hdr = NULL;
+	struct ipv6hdr *ipv6_hdr = NULL;
 	struct udphdr *udp_hdr;
 
 	__u16 tmp_port;
+	__u16 port, ssid;
 
 	struct stamp_test_pkt *sender_pkt;
+	struct stamp_test_pkt sender_copy;
 	struct stamp_reply_pkt *reflector_pkt;
+	struct reflect_state st = {};
 	
 	int ip_hdrsize;
-
-	/* Parse ethernet header */
-	eth_hdr = nh->pos;
-	if (nh->pos + sizeof(*eth_hdr) > data_end)
+	int h_proto;
+	__u8 ttl;
+	__s64 csum;
+	__u64 rx_ns;
+
+	/* Parse ethernet header, VLAN tags are skipped and kept in the reply */
+	h_proto = parse_ethhdr(nh, data_end, &eth_hdr);
+	if (h_proto < 0)
 		return NULL;
-	if (eth_hdr->h_proto != bpf_htons(ETH_P_IP))
-		return NULL;	
-	nh->pos += sizeof(*eth_hdr);
 
-	/* Parse IPv4 header */
-	ipv4_hdr = nh->pos;
-	if (ipv4_hdr + 1 > data_end)
-		return NULL;
-	ip_hdrsize = ipv4_hdr->ihl * 4;
-	// Sanity check packet field is valid
-	if(ip_hdrsize < sizeof(*ipv4_hdr))
-		return NULL;
-	// Variable-length IPv4 header, need to use byte-based arithmetic
-	if (nh->pos + ip_hdrsize > data_end)
-		return NULL;
-	// Check if UDP
-	if (ipv4_hdr->protocol != IPPROTO_UDP) {
+	if (h_proto == bpf_htons(ETH_P_IP)) {
+		/* Parse IPv4 header */
+		ipv4_hdr = nh->pos;
+		if (ipv4_hdr + 1 > data_end)
+			return NULL;
+		ip_hdrsize = ipv4_hdr->ihl * 4;
+		// Sanity check packet field is valid
+		if(ip_hdrsize < sizeof(*ipv4_hdr))
+			return NULL;
+		// Variable-length IPv4 header, need to use byte-based arithmetic
+		if (nh->pos + ip_hdrsize > data_end)
+			return NULL;
+		// Check if UDP
+		if (ipv4_hdr->protocol != IPPROTO_UDP) {
+			return NULL;
+		}
+		// Only reflect test packets sent to the configured address
+		if (local_ip_version == 6 ||
+		    (local_ip_version == 4 && ipv4_hdr->daddr != local_ipv4))
+			return NULL;
+		ttl = ipv4_hdr->ttl;
+		nh->pos += ip_hdrsize;
+	} else if (h_proto == bpf_htons(ETH_P_IPV6)) {
+		/* Parse IPv6 header, extension headers are not supported */
+		if (parse_ip6hdr(nh, data_end, &ipv6_hdr) != IPPROTO_UDP)
+			return NULL;
+		if (local_ip_version == 4)
+			return NULL;
+		if (local_ip_version == 6 &&
+		    (ipv6_hdr->daddr.in6_u.u6_addr32[0] != local_ipv6[0] ||
+		     ipv6_hdr->daddr.in6_u.u6_addr32[1] != local_ipv6[1] ||
+		     ipv6_hdr->daddr.in6_u.u6_addr32[2] != local_ipv6[2] ||
+		     ipv6_hdr->daddr.in6_u.u6_addr32[3] != local_ipv6[3]))
+			return NULL;
+		ttl = ipv6_hdr->hop_limit;
+	} else {
 		return NULL;
 	}
-	nh->pos += ip_hdrsize;
 
 	/* Parse UDP header */
 	udp_hdr = nh->pos;
@@ -107,8 +558,12 @@ static __always_inline struct stamp_reply_pkt* rewrite_stamp_packet(struct hdr_c
 		return NULL;
 	}
 	
-	// Check UDP source port, STAMP uses 862 by default
-	if (bpf_ntohs(udp_hdr->dest) != 862)
+	// Check UDP destination port, STAMP uses 862 by default
+	port = bpf_ntohs(udp_hdr->dest);
+	if (port < stamp_port_min || port > stamp_port_max)
+		return NULL;
+	// The UDP checksum is mandatory for IPv6 (RFC 8200)
+	if (ipv6_hdr && !udp_hdr->check)
 		return NULL;
 	nh->pos  = udp_hdr + 1;
 
@@ -121,51 +576,88 @@ static __always_inline struct stamp_reply_pkt* rewrite_stamp_packet(struct hdr_c
      sender_pkt->mbz[4] || sender_pkt->mbz[5] || sender_pkt->mbz[6]){
 		return NULL;
 	}
+	ssid = bpf_ntohs(sender_pkt->ssid);
+	if (ssid < ssid_min || ssid > ssid_max)
+		return NULL;
+
+	/* A test packet, take its receive time. Left to the stack while
+	 * reflector_user has not written the clock offsets yet.
+	 */
+	if (!clock_offsets_valid())
+		return NULL;
+	rx_ns = get_test_rx(ctx, &st.rx_method);
+
+	st.pkt = sender_pkt;
+	st.data_end = data_end;
+	st.eth = eth_hdr;
+	st.ipv4 = ipv4_hdr;
+	st.ipv6 = ipv6_hdr;
+	st.udp = udp_hdr;
+	st.end = bpf_ntohs(udp_hdr->len) - sizeof(*udp_hdr);
+	if (st.end > STAMP_TLV_END_MAX)
+		st.end = STAMP_TLV_END_MAX;
+
+	/* Both read the headers of the test packet, before the swap */
+	if (stateful)
+		session_seq(&st);
+	if (st.end > sizeof(struct stamp_test_pkt))
+		process_tlvs(&st);
 
     /* Swap IP source and destination */
-	swap_src_dst_ipv4(ipv4_hdr);
+	if (ipv4_hdr)
+		swap_src_dst_ipv4(ipv4_hdr);
+	else
+		swap_src_dst_ipv6(ipv6_hdr);
 
 	/* Swap Ethernet source and destination */
 	swap_src_dst_mac(eth_hdr);
 
-	/* Patch the packet and update the checksum */
-	udp_hdr->check = 0;
-
 	//swap udp dest and source port here
+	//swapping addresses and ports leaves the checksum unchanged
 	tmp_port = udp_hdr->source;
     udp_hdr->source = udp_hdr->dest;
     udp_hdr->dest = tmp_port;
 
-	// 在交换端口后，更新校验和
-    if (udp_hdr->check != 0) { // 如果原始校验和不为0，则需要更新
-        update_checksum(&udp_hdr->check, udp_hdr->source, tmp_port);
-        update_checksum(&udp_hdr->check, udp_hdr->dest, udp_hdr->source);
-    }
-
 	//store temp data for sender_pkt
-	__be32 seq_sender = sender_pkt->seq;
-	__be32 sender_tx_timestamp_0 = sender_pkt->sender_tx_timestamp[0];
-	__be32 sender_tx_timestamp_1 = sender_pkt->sender_tx_timestamp[1];
-	__be16 error_est_sender = sender_pkt->error_est;
-	__be16 ssid_sender = sender_pkt->ssid;
+	__builtin_memcpy(&sender_copy, sender_pkt, sizeof(sender_copy));
 
 	//update reflector_pkt with stored data
 	reflector_pkt = nh->pos;
 
-	reflector_pkt->seq = seq_sender;
-	reflector_pkt->tx_timestamp[0] = sender_tx_timestamp_0;
-	reflector_pkt->tx_timestamp[1] = sender_tx_timestamp_1;
-	reflector_pkt->error_est = error_est_sender;
-	reflector_pkt->ssid = ssid_sender;
-	reflector_pkt->rx_timestamp[0] = sender_tx_timestamp_0;
-	reflector_pkt->rx_timestamp[1] = sender_tx_timestamp_1;
-	reflector_pkt->sender_seq = ssid_sender;
-	reflector_pkt->sender_tx_timestamp[0] = sender_tx_timestamp_0;
-	reflector_pkt->sender_tx_timestamp[1] = sender_tx_timestamp_1;
-	reflector_pkt->sender_error_est = error_est_sender;
+	/* A stateless reflector returns the sender's sequence number, a
+	 * stateful one its own. The timestamps use the sender's format, NTP
+	 * or PTPv2 (Z flag).
+	 */
+	reflector_pkt->seq = stateful ? bpf_htonl(st.seq) : sender_copy.seq;
+	reflector_pkt->error_est = reply_error_est(sender_copy.error_est);
+	reflector_pkt->ssid = sender_copy.ssid;
+	store_timestamp(reflector_pkt->rx_timestamp, rx_ns, reflector_pkt->error_est);
+	reflector_pkt->sender_seq = sender_copy.seq;
+	reflector_pkt->sender_tx_timestamp[0] = sender_copy.sender_tx_timestamp[0];
+	reflector_pkt->sender_tx_timestamp[1] = sender_copy.sender_tx_timestamp[1];
+	reflector_pkt->sender_error_est = sender_copy.error_est;
 	reflector_pkt->mbz16 = 0;
-	reflector_pkt->sender_ttl = 0;
-
+	reflector_pkt->sender_ttl = ttl;
+	reflector_pkt->mbz8[0] = 0;
+	reflector_pkt->mbz8[1] = 0;
+	reflector_pkt->mbz8[2] = 0;
+	/* Taken last, as close to the transmission as XDP gets */
+	store_timestamp(reflector_pkt->tx_timestamp, get_kernel_ns(), reflector_pkt->error_est);
+
+	/* Update the UDP checksum with the difference of the rewritten STAMP
+	 * packet and TLVs. A zero checksum means none for IPv4 and is kept as
+	 * is.
+	 */
+	if (udp_hdr->check) {
+		csum = bpf_csum_diff((__be32 *)&sender_copy, sizeof(sender_copy),
+				     (__be32 *)reflector_pkt, sizeof(*reflector_pkt),
+				     ~((__u32)udp_hdr->check) & 0xFFFF);
+		if (csum < 0)
+			return NULL;
+		udp_hdr->check = csum_fold_helper((__u32)csum + (__u64)st.csum);
+		if (!udp_hdr->check)
+			udp_hdr->check = 0xFFFF;
+	}
 
 	return reflector_pkt;
 }
@@ -180,14 +672,46 @@ int  stamp_reflector(struct xdp_md *ctx)
 
 	nh.pos = data;
 	
-	stamp_pkt = rewrite_stamp_packet(&nh, data_end);
+	stamp_pkt = rewrite_stamp_packet(&nh, data_end, ctx);
 	
 	if (stamp_pkt){
+		ssid_stats_record(stamp_pkt->ssid, data_end - data);
 		//With XDP_TX, eBPF will redirect packet to the original interface
-		return XDP_TX;
+		return xdp_stats_record_action(ctx, XDP_TX);
 	}else{
-		return XDP_PASS;
+		return xdp_stats_record_action(ctx, XDP_PASS);
 	}
 }
 
+/* tc (clsact ingress) variant for drivers with poor native XDP support */
+SEC("tc")
+int  stamp_reflector_tc(struct __sk_buff *skb)
+{
+	void *data_end;
+	void *data;
+	struct hdr_cursor nh;
+	struct stamp_reply_pkt *stamp_pkt;
+	__u32 pull_len = STAMP_TC_PULL_LEN + STAMP_TLV_AREA_MAX;
+
+	/* Headers, STAMP payload and TLVs must be in the linear part of the skb */
+	if (skb->len < pull_len)
+		pull_len = skb->len;
+	if ((void *)(long)skb->data + pull_len > (void *)(long)skb->data_end)
+		bpf_skb_pull_data(skb, pull_len);
+	data_end = (void *)(long)skb->data_end;
+	data = (void *)(long)skb->data;
+	nh.pos = data;
+
+	stamp_pkt = rewrite_stamp_packet(&nh, data_end, NULL);
+	if (!stamp_pkt) {
+		tc_stats_record_action(skb, XDP_PASS);
+		return TC_ACT_OK;
+	}
+	ssid_stats_record(stamp_pkt->ssid, skb->len);
+	tc_stats_record_action(skb, XDP_TX);
+
+	//Like XDP_TX, send the reply out of the interface it arrived on
+	return bpf_redirect(skb->ifindex, 0);
+}
+
 char _license[] SEC("license") = "GPL";
\ No newline at end of file
@@ -0,0 +1,561 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+static const char *__doc__ = "STAMP reflector loader and stats program\n"
+	" - Attaches the reflector to every --dev and keeps its clock offsets current\n"
+	" - Pins its maps and prints the STAMP load it carries every --interval\n";
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include <locale.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <xdp/libxdp.h>
+
+#include <net/if.h>
+#include <linux/if_link.h> /* depend on kernel-headers installed */
+
+#include "../common/common_params.h"
+#include "../common/common_user_bpf_xdp.h"
+#include "../common/common_clock.h"
+#include "../common/xdp_stats_kern_user.h"
+#include "reflector.h"
+
+static const char *default_filename = "reflector_kern.o";
+static const char *default_progname = "stamp_reflector";
+static const char *default_tc_progname = "stamp_reflector_tc";
+
+#define WAIT_POLL_MS 100
+#define DEFAULT_INTERVAL_MS 1000
+
+/* Maps are pinned under <pin_dir>/<ifname> for other tools to read, the
+ * pin_dir defaults to PIN_BASEDIR
+ */
+#define PIN_BASEDIR "/sys/fs/bpf"
+static const char *pinned_maps[] = {
+	"xdp_stats_map",
+	"ssid_stats_map",
+	"reflector_session_map",
+	"clock_offset_map",
+};
+#define NUM_PINNED_MAPS (sizeof(pinned_maps) / sizeof(pinned_maps[0]))
+
+#define NUM_SSIDS (1 << 16)
+
+/* Counter snapshot, totals since the reflector was loaded */
+struct stats_record {
+	__u64 timestamp;	/* ms */
+	struct datarec action[XDP_ACTION_MAX];
+	struct datarec *ssid;	/* NUM_SSIDS, zero if never seen */
+};
+
+/* The reflector on one device, each has its own object and maps except
+ * clock_offset_map, which all share
+ */
+struct reflector_dev {
+	struct config cfg;		/* The options, ifindex and ifname of this device */
+	struct xdp_program *program;	/* NULL if attached to tc */
+	struct bpf_object *obj;
+	char pin_dir[PATH_MAX];
+	int stats_fd;
+	int ssid_fd;
+	struct stats_record stats[2];
+	struct stats_record *prev, *cur;
+	int phc_fd;			/* --hw-timestamp: the NIC's PTP clock, else -1 */
+	clockid_t phc_clock;
+	int phc_map_fd;
+	bool attached;
+};
+
+/* The devices while they are being loaded, see rollback_devs() */
+static struct reflector_dev *loading_devs;
+static int nr_loading_devs;
+
+static volatile sig_atomic_t exiting;
+
+static void handle_signal(int sig)
+{
+	exiting = 1;
+}
+
+static __u64 now_ms(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Pin (or with unpin, remove) the maps under dir. Pins of a previous load
+ * are replaced.
+ */
+static int pin_reflector_maps(struct bpf_object *obj, const char *dir, bool unpin)
+{
+	char path[PATH_MAX];
+	struct bpf_map *map;
+	int err;
+
+	if (!unpin && mkdir(dir, 0700) && errno != EEXIST)
+		return -errno;
+	for (int i = 0; i < NUM_PINNED_MAPS; i++) {
+		if (snprintf(path, sizeof(path), "%s/%s", dir, pinned_maps[i]) >= sizeof(path))
+			return -ENAMETOOLONG;
+		if (unlink(path) && errno != ENOENT)
+			return -errno;
+		if (unpin)
+			continue;
+		map = bpf_object__find_map_by_name(obj, pinned_maps[i]);
+		if (!map)
+			return -ENOENT;
+		err = bpf_map__pin(map, path);
+		if (err)
+			return err;
+	}
+	if (unpin)
+		rmdir(dir);
+	return 0;
+}
+
+/* Sum a key of a per-CPU map of struct datarec over all CPUs */
+static int sum_datarec(int map_fd, const void *key, struct datarec *sum)
+{
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct datarec values[nr_cpus];
+
+	memset(sum, 0, sizeof(*sum));
+	if (bpf_map_lookup_elem(map_fd, key, values) != 0)
+		return -errno;
+	for (int cpu = 0; cpu < nr_cpus; cpu++) {
+		sum->rx_packets += values[cpu].rx_packets;
+		sum->rx_bytes += values[cpu].rx_bytes;
+	}
+	return 0;
+}
+
+static void collect_stats(int stats_fd, int ssid_fd, struct stats_record *rec)
+{
+	__u16 ssid, *prev = NULL;
+
+	rec->timestamp = now_ms();
+	for (__u32 action = 0; action < XDP_ACTION_MAX; action++)
+		sum_datarec(stats_fd, &action, &rec->action[action]);
+	/* SSIDs evicted from the LRU keep their last counters */
+	while (bpf_map_get_next_key(ssid_fd, prev, &ssid) == 0) {
+		sum_datarec(ssid_fd, &ssid, &rec->ssid[ssid]);
+		prev = &ssid;
+	}
+}
+
+/* One line of packet and bit rates between two snapshots of a counter. A
+ * counter that went backwards was evicted and counts from 0 again.
+ */
+static void print_rate(const char *name, const struct datarec *prev,
+		       const struct datarec *cur, double period)
+{
+	__u64 packets = cur->rx_packets, bytes = cur->rx_bytes;
+
+	if (packets >= prev->rx_packets) {
+		packets -= prev->rx_packets;
+		bytes -= prev->rx_bytes;
+	}
+	printf("%-14s %'13.0f pps %'13.3f Mbit/s  total %'llu packets\n", name,
+	       packets / period, bytes * 8 / period / 1000000,
+	       (unsigned long long)cur->rx_packets);
+}
+
+/* Every action, and the SSIDs replied to in the period */
+static void print_stats(const char *ifname, const struct stats_record *prev,
+			const struct stats_record *cur)
+{
+	double period = (cur->timestamp - prev->timestamp) / 1000.0;
+	char name[16];
+
+	if (period <= 0)
+		return;
+	printf("\n%s\n", ifname);
+	for (__u32 action = 0; action < XDP_ACTION_MAX; action++)
+		print_rate(action2str(action), &prev->action[action], &cur->action[action], period);
+	for (int ssid = 0; ssid < NUM_SSIDS; ssid++) {
+		if (cur->ssid[ssid].rx_packets == prev->ssid[ssid].rx_packets)
+			continue;
+		snprintf(name, sizeof(name), "SSID %d", ssid);
+		print_rate(name, &prev->ssid[ssid], &cur->ssid[ssid], period);
+	}
+}
+
+static int set_reflector_rodata(struct bpf_object *obj, const struct config *cfg, bool tai){
+	__u8 hw_rx_timestamp = cfg->hw_rx_timestamp;
+	__u8 tai_clock = tai;
+	__u8 stateful = cfg->stateful;
+	int err;
+
+	err = set_rodata_var(obj, "hw_rx_timestamp", &hw_rx_timestamp, sizeof(hw_rx_timestamp));
+	if (!err)
+		err = set_rodata_var(obj, "tai_clock", &tai_clock, sizeof(tai_clock));
+	if (!err)
+		err = set_rodata_var(obj, "stateful", &stateful, sizeof(stateful));
+	if (!err)
+		err = set_stamp_filter_rodata(obj, cfg);
+	return err;
+}
+
+static void print_clock_stats(const struct clock_tracker *ct){
+	int key = ct->tai ? CLOCK_OFFSET_TAI : CLOCK_OFFSET_MONO;
+
+	printf("Timestamps from %s, offset refreshed %llu times: largest step %lld ns, read uncertainty %lld ns\n",
+	       ct->tai ? "CLOCK_TAI" : "CLOCK_MONOTONIC", (unsigned long long)ct->refreshes,
+	       (long long)ct->max_step[key], (long long)ct->max_uncertainty);
+}
+
+/* --hw-timestamp: the reflector converts the NIC's RX timestamps to
+ * CLOCK_REALTIME, the clock of its TX timestamps, with the offset of the
+ * PTP hardware clock, measured like those of the kernel clocks
+ */
+static int refresh_phc_offset(struct reflector_dev *dev)
+{
+	__u32 key = PHC_OFFSET, valid_key = PHC_OFFSET_VALID;
+	__s64 offset, uncertainty, valid = 1;
+	int err;
+
+	err = measure_clock_offset(dev->phc_clock, &offset, &uncertainty);
+	if (!err && (bpf_map_update_elem(dev->phc_map_fd, &key, &offset, BPF_EXIST) != 0 ||
+		     bpf_map_update_elem(dev->phc_map_fd, &valid_key, &valid, BPF_EXIST) != 0))
+		err = -errno;
+	if (err)
+		fprintf(stderr, "ERR: PTP hardware clock offset of %s: %s\n", dev->cfg.ifname,
+			strerror(-err));
+	return err;
+}
+
+/* Detach the reflector from a device and remove its pins */
+static int unload_dev(struct reflector_dev *dev)
+{
+	struct config *cfg = &dev->cfg;
+	char errmsg[1024];
+	int err;
+
+	pin_reflector_maps(NULL, dev->pin_dir, true);
+	if (cfg->tc_attach) {
+		err = do_tc_unload(cfg);
+		if (err)
+			return err;
+
+		printf("Success: Unloading tc prog name: %s from %s\n", cfg->progname, cfg->ifname);
+		return EXIT_OK;
+	}
+	err = do_unload(cfg);
+	if (err) {
+		libxdp_strerror(err, errmsg, sizeof(errmsg));
+		fprintf(stderr, "Couldn't unload XDP program %d from %s: %s\n",
+			cfg->prog_id, cfg->ifname, errmsg);
+		return err;
+	}
+
+	printf("Success: Unloading XDP prog name: %s from %s\n", cfg->progname, cfg->ifname);
+	return EXIT_OK;
+}
+
+/* Loading a device failed: detach the reflector again from those already
+ * attached and remove their pins, leaving the devices as they were. The
+ * attach helpers exit() on failure, so this runs from atexit() until every
+ * device is loaded.
+ */
+static void rollback_devs(void)
+{
+	for (int i = 0; i < nr_loading_devs; i++) {
+		struct reflector_dev *dev = &loading_devs[i];
+
+		if (!dev->attached)
+			continue;
+		fprintf(stderr, "Detaching the reflector from %s again\n", dev->cfg.ifname);
+		/* Only our program, not others behind the same dispatcher */
+		if (dev->program)
+			dev->cfg.prog_id = attached_xdp_prog_id(dev->program);
+		dev->cfg.unload_all = false;
+		unload_dev(dev);
+	}
+}
+
+/* Configure, attach and pin the reflector on a device. The clock offsets
+ * are written before it is attached, so it never reflects with
+ * timestamps since boot.
+ */
+static int load_dev(struct reflector_dev *dev, struct clock_tracker *clock)
+{
+	struct config *cfg = &dev->cfg;
+	int err;
+
+	if (cfg->hw_rx_timestamp && !cfg->tc_attach) {
+		dev->phc_fd = phc_open(cfg->ifname, &dev->phc_clock);
+		if (dev->phc_fd < 0) {
+			fprintf(stderr, "ERR: --hw-timestamp needs the PTP hardware clock of %s: %s\n",
+				cfg->ifname, strerror(-dev->phc_fd));
+			return EXIT_FAIL_OPTION;
+		}
+	}
+
+	if (cfg->tc_attach) {
+		dev->obj = open_bpf_object_file(cfg);
+	} else {
+		dev->program = create_xdp_program(cfg);
+		dev->obj = xdp_program__bpf_obj(dev->program);
+	}
+	err = set_reflector_rodata(dev->obj, cfg, clock->tai);
+	if (!err && cfg->hw_rx_timestamp && dev->program)
+		err = set_xdp_dev_bound(dev->program, cfg->ifindex);
+	/* Shared by all devices, they stay at the last value written once
+	 * we exit
+	 */
+	if (!err)
+		err = clock_tracker_use(clock, dev->obj);
+	if (err) {
+		fprintf(stderr, "ERR: configuring %s for %s: %s\n", cfg->filename, cfg->ifname,
+			strerror(-err));
+		return EXIT_FAIL_BPF;
+	}
+	if (cfg->tc_attach)
+		attach_tc_program(dev->obj, cfg);
+	else
+		attach_xdp_program(dev->program, cfg);
+	dev->attached = true;
+
+	if (verbose) {
+		if (dev->program)
+			printf(" - XDP prog id:%d attached on device:%s(ifindex:%d)\n",
+			       attached_xdp_prog_id(dev->program), cfg->ifname, cfg->ifindex);
+		else
+			printf(" - tc prog attached on device:%s(ifindex:%d) ingress\n",
+			       cfg->ifname, cfg->ifindex);
+	}
+
+	err = pin_reflector_maps(dev->obj, dev->pin_dir, false);
+	if (err) {
+		fprintf(stderr, "ERR: pinning maps in %s: %s\n", dev->pin_dir, strerror(-err));
+		return EXIT_FAIL_BPF;
+	}
+	if (verbose)
+		printf("   maps pinned in %s\n", dev->pin_dir);
+
+	/* RX timestamps fall back to the kernel clock until this is written */
+	if (dev->phc_fd >= 0) {
+		dev->phc_map_fd = bpf_object__find_map_fd_by_name(dev->obj, "phc_offset_map");
+		if (dev->phc_map_fd < 0 || refresh_phc_offset(dev) != 0)
+			return EXIT_FAIL_BPF;
+	}
+
+	dev->stats_fd = bpf_object__find_map_fd_by_name(dev->obj, "xdp_stats_map");
+	dev->ssid_fd = bpf_object__find_map_fd_by_name(dev->obj, "ssid_stats_map");
+	if (dev->stats_fd < 0 || dev->ssid_fd < 0) {
+		fprintf(stderr, "ERR: cannot find the stats maps\n");
+		return EXIT_FAIL_BPF;
+	}
+	dev->prev = &dev->stats[0];
+	dev->cur = &dev->stats[1];
+	dev->prev->ssid = calloc(NUM_SSIDS, sizeof(struct datarec));
+	dev->cur->ssid = calloc(NUM_SSIDS, sizeof(struct datarec));
+	if (!dev->prev->ssid || !dev->cur->ssid) {
+		fprintf(stderr, "ERR: out of memory\n");
+		return EXIT_FAIL;
+	}
+	collect_stats(dev->stats_fd, dev->ssid_fd, dev->prev);
+	return 0;
+}
+
+/* Print the rates since the last call */
+static void report_dev(struct reflector_dev *dev)
+{
+	struct stats_record *tmp;
+
+	/* The SSID counters are cumulative, carry them over */
+	memcpy(dev->cur->ssid, dev->prev->ssid, NUM_SSIDS * sizeof(struct datarec));
+	collect_stats(dev->stats_fd, dev->ssid_fd, dev->cur);
+	print_stats(dev->cfg.ifname, dev->prev, dev->cur);
+	tmp = dev->prev;
+	dev->prev = dev->cur;
+	dev->cur = tmp;
+}
+
+static const struct option_wrapper long_options[] = {
+	{{"help",        no_argument,		NULL, 'h' },
+	 "Show help", false},
+
+	{{"dev",         required_argument,	NULL, 'd' },
+	 "Operate on device <ifname>, may be repeated", "<ifname>", true},
+
+	{{"skb-mode",    no_argument,		NULL, 'S' },
+	 "Install XDP program in SKB (AKA generic) mode"},
+
+	{{"native-mode", no_argument,		NULL, 'N' },
+	 "Install XDP program in native mode"},
+
+	{{"auto-mode",   no_argument,		NULL, 'A' },
+	 "Auto-detect SKB or native mode"},
+
+	{{"unload",      required_argument,	NULL, 'U' },
+	 "Unload XDP program <id> instead of loading, with a single --dev", "<id>"},
+
+	{{"unload-all",  no_argument,           NULL,  4  },
+	 "Unload all XDP programs on device"},
+
+	{{"quiet",       no_argument,		NULL, 'q' },
+	 "Quiet mode (no output)"},
+
+	{{"filename",    required_argument,	NULL,  1  },
+	 "Load program from <file>", "<file>"},
+
+	{{"progname",    required_argument,	NULL,  2  },
+	 "Load program from function <name> in the ELF file", "<name>"},
+
+	{{"duration",	 required_argument,	NULL, 't' },
+	 "Keep the clock offsets current for <seconds>, 0 until interrupted", "<seconds>"},
+
+	{{"interval",	 required_argument,	NULL,  6  },
+	 "Print packet and bit rates every <ms>, default 1000, 0 to disable", "<ms>"},
+
+	{{"port",	 required_argument,	NULL,  7  },
+	 "Reflect on UDP <port> or <port>-<port> range, default 862", "<port>"},
+
+	{{"ssid",	 required_argument,	NULL,  8  },
+	 "Only reflect SSID <ssid> or <ssid>-<ssid> range", "<ssid>"},
+
+	{{"local-addr",	 required_argument,	NULL,  9  },
+	 "Only reflect test packets sent to IPv4/IPv6 <addr>", "<addr>"},
+
+	{{"hw-timestamp", no_argument,		NULL,  11 },
+	 "Take the receive timestamp from the NIC's PTP clock when available"},
+
+	{{"tc",		 no_argument,		NULL,  12 },
+	 "Attach to tc (clsact) ingress instead of XDP"},
+
+	{{"stateful",	 no_argument,		NULL,  20 },
+	 "Stateful reflector: number the replies of each session itself (Linux 5.12+)"},
+
+	{{"pin-dir",	 required_argument,	NULL,  21 },
+	 "Pin the maps of every device in <dir>/<ifname>, default " PIN_BASEDIR, "<dir>"},
+
+	{{0, 0, NULL,  0 }}
+};
+
+int main(int argc, char **argv)
+{
+	struct reflector_dev *devs;
+	__u64 end, next;
+	int nr_devs, i;
+	int err = 0;
+
+	struct config cfg = {
+		.ifindex   = -1,
+		.do_unload = false,
+		.interval  = DEFAULT_INTERVAL_MS,
+	};
+	/* Set default BPF-ELF object file and BPF program name */
+	strncpy(cfg.filename, default_filename, sizeof(cfg.filename));
+	strncpy(cfg.progname,  default_progname,  sizeof(cfg.progname));
+	strncpy(cfg.pin_dir, PIN_BASEDIR, sizeof(cfg.pin_dir));
+	/* Cmdline options can change progname */
+	parse_cmdline_args(argc, argv, long_options, &cfg, __doc__);
+	if (cfg.tc_attach && strcmp(cfg.progname, default_progname) == 0)
+		strncpy(cfg.progname, default_tc_progname, sizeof(cfg.progname));
+	if (cfg.tc_attach && cfg.hw_rx_timestamp)
+		fprintf(stderr, "WARN: --hw-timestamp needs XDP, using the kernel clock\n");
+
+	/* Required option */
+	if (cfg.nr_devs == 0) {
+		fprintf(stderr, "ERR: required option --dev missing\n");
+		usage(argv[0], __doc__, long_options, (argc == 1));
+		return EXIT_FAIL_OPTION;
+	}
+	nr_devs = cfg.nr_devs;
+	devs = calloc(nr_devs, sizeof(*devs));
+	if (!devs) {
+		fprintf(stderr, "ERR: out of memory\n");
+		return EXIT_FAIL;
+	}
+	for (i = 0; i < nr_devs; i++) {
+		struct config *dev_cfg = &devs[i].cfg;
+
+		*dev_cfg = cfg;
+		dev_cfg->ifindex = cfg.dev_ifindex[i];
+		dev_cfg->ifname = dev_cfg->ifname_buf;
+		strncpy(dev_cfg->ifname, cfg.dev_ifname[i], IF_NAMESIZE);
+		devs[i].phc_fd = -1;
+		if (snprintf(devs[i].pin_dir, sizeof(devs[i].pin_dir), "%s/%s",
+			     cfg.pin_dir, dev_cfg->ifname) >= sizeof(devs[i].pin_dir)) {
+			fprintf(stderr, "ERR: --pin-dir path too long\n");
+			return EXIT_FAIL_OPTION;
+		}
+	}
+
+	/* Unload from every device, even if one of them fails */
+	if (cfg.do_unload && !cfg.tc_attach && nr_devs > 1) {
+		fprintf(stderr, "ERR: --unload <id> takes a single --dev, program ids differ by device; use --unload-all\n");
+		return EXIT_FAIL_OPTION;
+	}
+	if (cfg.do_unload || cfg.unload_all) {
+		for (i = 0; i < nr_devs; i++) {
+			int dev_err = unload_dev(&devs[i]);
+
+			if (dev_err)
+				err = dev_err;
+		}
+		return err;
+	}
+
+	/* Prefer CLOCK_TAI, which moves with CLOCK_REALTIME, if BPF can read it */
+	struct clock_tracker clock = { .map_fd = -1 };
+	clock.tai = clock_tai_usable(cfg.tc_attach ? BPF_PROG_TYPE_SCHED_CLS : BPF_PROG_TYPE_XDP);
+	if (verbose)
+		printf("Success: Loading BPF-object(%s) and using section(%s)\n",
+		       cfg.filename, cfg.progname);
+	loading_devs = devs;
+	atexit(rollback_devs);
+	for (i = 0; i < nr_devs; i++) {
+		nr_loading_devs = i + 1;
+		err = load_dev(&devs[i], &clock);
+		if (err)
+			return err;
+	}
+	nr_loading_devs = 0;
+	if (cfg.stateful && verbose)
+		printf(" - Stateful, sequence numbers of up to %d sessions per device\n",
+		       REFLECTOR_MAX_SESSIONS);
+
+	/* Trick to pretty printf with thousands separators use %' */
+	setlocale(LC_NUMERIC, "en_US");
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	end = now_ms() + (__u64)cfg.duration * 1000;
+	next = now_ms() + cfg.interval;
+	while (!exiting && (cfg.duration <= 0 || now_ms() < end)) {
+		__u64 refreshes = clock.refreshes;
+
+		clock_tracker_tick(&clock);
+		for (i = 0; i < nr_devs && clock.refreshes != refreshes; i++)
+			if (devs[i].phc_fd >= 0)
+				refresh_phc_offset(&devs[i]);
+		if (cfg.interval > 0 && verbose && now_ms() >= next) {
+			for (i = 0; i < nr_devs; i++)
+				report_dev(&devs[i]);
+			next += cfg.interval;
+		}
+		usleep(WAIT_POLL_MS * 1000);
+	}
+
+	print_clock_stats(&clock);
+	for (i = 0; i < nr_devs; i++) {
+		free(devs[i].stats[0].ssid);
+		free(devs[i].stats[1].ssid);
+		if (devs[i].phc_fd >= 0)
+			close(devs[i].phc_fd);
+	}
+	free(devs);
+	return EXIT_OK;
+}
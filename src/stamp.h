@@ -3,6 +3,19 @@
 #ifndef STAMP_H
 #define STAMP_H
 
+/* Well-known STAMP UDP port (RFC 8762) */
+#define STAMP_PORT 862
+
+/* Ethernet with two VLAN tags, IPv6 and UDP headers followed by a STAMP
+ * packet without TLVs. The tc programs pull this much into the linear
+ * part of the skb.
+ */
+#define STAMP_TC_PULL_LEN (14 + 2 * 4 + 40 + 8 + 44)
+
+/* TLV bytes after the base packet the reflector processes, TLVs beyond are
+ * reflected unchanged
+ */
+#define STAMP_TLV_AREA_MAX 1024
 
 /*
 
@@ -84,5 +97,88 @@ struct stamp_reply_pkt {
 };
 
 
+/*
+
+STAMP TLV (RFC 8972), the Length counts the Value octets only. Sub-TLVs
+have the same format.
+  0                   1                   2                   3
+  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ |U|M|I| Reserved|     Type      |            Length             |
+ +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ ~                            Value                              ~
+ +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+
+ */
+struct stamp_tlv_hdr {
+	__u8 flags;
+	__u8 type;
+	__be16 length;
+};
+
+// STAMP TLV Flags, set by the Session-Reflector
+#define STAMP_TLV_FLAG_U 0x80 // Type not recognized
+#define STAMP_TLV_FLAG_M 0x40 // Malformed
+#define STAMP_TLV_FLAG_I 0x20 // Integrity check failed
+
+enum stamp_tlv_type {
+	STAMP_TLV_EXTRA_PADDING = 1,
+	STAMP_TLV_LOCATION = 2,
+	STAMP_TLV_TIMESTAMP_INFO = 3,
+	STAMP_TLV_CLASS_OF_SERVICE = 4,
+	STAMP_TLV_DIRECT_MEASUREMENT = 5,
+	STAMP_TLV_ACCESS_REPORT = 6,
+	STAMP_TLV_FOLLOW_UP_TELEMETRY = 7,
+	STAMP_TLV_HMAC = 8,
+};
+
+// Location TLV, followed by sub-TLVs the Session-Reflector fills in
+struct stamp_tlv_location {
+	__be16 dest_port;
+	__be16 src_port;
+};
+
+enum stamp_sub_tlv_type {
+	STAMP_SUB_TLV_SRC_MAC = 1,	// 6 octets, then MBZ
+	STAMP_SUB_TLV_DEST_IPV4 = 2,
+	STAMP_SUB_TLV_DEST_IPV6 = 3,
+	STAMP_SUB_TLV_SRC_IPV4 = 4,
+	STAMP_SUB_TLV_SRC_IPV6 = 5,
+};
+
+// Timestamp Information TLV
+struct stamp_tlv_timestamp_info {
+	__u8 sync_src_in;	// enum stamp_sync_src
+	__u8 timestamp_in;	// enum stamp_timestamp_method
+	__u8 sync_src_out;
+	__u8 timestamp_out;
+};
+
+enum stamp_sync_src {
+	STAMP_SYNC_NTP = 1,
+	STAMP_SYNC_PTP = 2,
+	STAMP_SYNC_SSU_BITS = 3,
+	STAMP_SYNC_GNSS = 4,
+	STAMP_SYNC_LOCAL = 5,	// Local free-running clock
+};
+
+enum stamp_timestamp_method {
+	STAMP_TIMESTAMP_HW = 1,
+	STAMP_TIMESTAMP_SW = 2,
+	STAMP_TIMESTAMP_CONTROL_PLANE = 3,
+};
+
+// Class of Service TLV: DSCP1 (6 bits), DSCP2 (6), ECN (2), RP (2), MBZ (16)
+struct stamp_tlv_cos {
+	__be16 dscp_ecn_rp;
+	__be16 mbz;
+};
+
+// Direct Measurement TLV, packet counters of the session
+struct stamp_tlv_direct_measurement {
+	__be32 sender_tx;	// S_TxC
+	__be32 reflector_rx;	// R_RxC
+	__be32 reflector_tx;	// R_TxC
+};
 
 #endif  /* STAMP_H */
\ No newline at end of file
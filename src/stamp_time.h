@@ -0,0 +1,107 @@
+#include <linux/types.h>
+
+#ifndef STAMP_TIME_H
+#define STAMP_TIME_H
+
+/*
+ * Timestamp conversions shared by the BPF programs and user space, in
+ * integer arithmetic only. Points in time are held as __u64 ns since the
+ * Unix epoch and differences as __s64 ns, which keeps nanosecond
+ * resolution where a double of seconds only resolves ~240 ns today.
+ *
+ * Wire formats (RFC 8762, Error Estimate Z flag):
+ *   NTP:   32-bit seconds since 1900 . 32-bit fraction (Z = 0)
+ *   PTPv2: 32-bit seconds since 1970 . 32-bit ns, the truncated PTPv2
+ *          timestamp (Z = 1)
+ * Both are handled as __u64 (seconds << 32 | fraction or ns), host order.
+ */
+
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+
+#define NTP_UNIX_OFFSET 2208988800 /* Seconds from 1900 to 1970 */
+#define NANOSEC_PER_SEC 1000000000 /* 10^9 */
+
+/* Error Estimate (RFC 4656 4.1.2): S, Z, 6 bits Scale, 8 bits Multiplier,
+ * the error is Multiplier * 2^(Scale - 32) seconds
+ */
+#define STAMP_ERR_EST_S 0x8000	/* Clock synchronized to UTC */
+#define STAMP_ERR_EST_Z 0x4000	/* Timestamps are PTPv2 instead of NTP */
+/* Not synchronized, largest error */
+#define STAMP_ERR_EST_UNKNOWN 0x3FFF
+
+static __always_inline __u64 stamp_ts64(__u32 seconds_part, __u32 fractional_part)
+{
+	return (__u64)seconds_part << 32 | fractional_part;
+}
+
+/* NTP timestamps before the Unix epoch do not convert, and are bogus anyway */
+static __always_inline int stamp_ntp_valid(__u64 ntp)
+{
+	return (ntp >> 32) >= NTP_UNIX_OFFSET;
+}
+
+/* NTP 32.32 to ns since the Unix epoch, the fraction rounded to nearest */
+static __always_inline __u64 stamp_ntp_to_ns(__u64 ntp)
+{
+	__u64 frac_ns = ((ntp & 0xffffffff) * NANOSEC_PER_SEC + (1ULL << 31)) >> 32;
+
+	return ((ntp >> 32) - NTP_UNIX_OFFSET) * NANOSEC_PER_SEC + frac_ns;
+}
+
+/* ns since the Unix epoch to NTP 32.32, exact inverse of stamp_ntp_to_ns() */
+static __always_inline __u64 stamp_ns_to_ntp(__u64 ns)
+{
+	__u64 sec = ns / NANOSEC_PER_SEC + NTP_UNIX_OFFSET;
+	__u64 frac = ((ns % NANOSEC_PER_SEC << 32) + NANOSEC_PER_SEC / 2) / NANOSEC_PER_SEC;
+
+	return sec << 32 | frac;
+}
+
+/* Truncated PTPv2 to ns since the Unix (PTP) epoch */
+static __always_inline __u64 stamp_ptp_to_ns(__u64 ptp)
+{
+	return (ptp >> 32) * NANOSEC_PER_SEC + (ptp & 0xffffffff);
+}
+
+static __always_inline __u64 stamp_ns_to_ptp(__u64 ns)
+{
+	return (ns / NANOSEC_PER_SEC) << 32 | ns % NANOSEC_PER_SEC;
+}
+
+/* A STAMP timestamp in the format given by its Error Estimate (host order) */
+static __always_inline __u64 stamp_ts_to_ns(__u64 ts, __u16 error_est)
+{
+	return error_est & STAMP_ERR_EST_Z ? stamp_ptp_to_ns(ts) : stamp_ntp_to_ns(ts);
+}
+
+/* Keys of clock_offset_map. The user programs keep the offsets current, so
+ * BPF programs convert kernel clock readings with the offset valid at the
+ * time, see common/common_clock.h.
+ */
+enum clock_offset_key {
+	CLOCK_OFFSET_MONO,	/* CLOCK_REALTIME - CLOCK_MONOTONIC */
+	CLOCK_OFFSET_TAI,	/* CLOCK_REALTIME - CLOCK_TAI, for bpf_ktime_get_tai_ns() */
+	CLOCK_ERROR_EST,	/* Error Estimate of CLOCK_REALTIME, Z clear, 0 if not set */
+	CLOCK_OFFSET_VALID,	/* Non-zero once the entries above are written; an
+				 * offset may well be 0, e.g. CLOCK_TAI without a
+				 * TAI-UTC offset set */
+	CLOCK_OFFSET_MAP_SIZE
+};
+
+/* A kernel clock reading (ktime ns) to ns since the Unix epoch, given
+ * offset_ns = CLOCK_REALTIME - that clock
+ */
+static __always_inline __u64 stamp_ktime_to_ns(__u64 ktime_ns, __s64 offset_ns)
+{
+	return ktime_ns + offset_ns;
+}
+
+/* Signed difference later - earlier of two points in time */
+static __always_inline __s64 stamp_delta_ns(__u64 later, __u64 earlier)
+{
+	return (__s64)(later - earlier);
+}
+
+#endif /* STAMP_TIME_H */